@@ -1,6 +1,48 @@
 
 #include "fs.h"
 
+// Blocks read in the background are read into these pages, just below
+// the request page in serv.c, and moved into the cache once they have
+// arrived, so nothing sees a block before its contents are there.
+#define BCSTAGE		(DISKMAP - (BC_MAXRUN + 1) * PGSIZE)
+
+static uint32_t async_blockno;	// first block being read in the background
+static uint32_t async_nblocks;	// number of blocks being read, or 0
+
+// The last NRA blocks that were read ahead of their use.  Each counts
+// as a hit when it is first read, or as waste if it is pushed out of
+// the ring before that.
+#define NRA		64
+
+static uint32_t ra_ring[NRA];
+static int ra_next;
+
+// The cache holds at most bc_budget blocks.  bc_slots lists the cached
+// blocks in the order the CLOCK hand visits them when one must go.
+static uint32_t bc_slots[BC_MAXSLOTS];
+static uint32_t bc_nslots, bc_hand;
+uint32_t bc_budget = BC_BUDGET;
+
+// Blocks written since they were last flushed.  Cached blocks are mapped
+// read-only until they are written; the write fault adds the block to
+// this list, tagged with bc_owner, and makes the page writable.  While a
+// block is on the list its page carries PTE_BC_DIRTY, so it is listed
+// only once.  Flushing a block makes its page read-only again.
+#define PTE_BC_DIRTY	0x200
+#define NBCDIRTY	(2 * BC_MAXSLOTS)
+
+struct BcDirty {
+    uint32_t d_blockno;
+    void *d_owner;
+};
+
+static struct BcDirty bc_dirty[NBCDIRTY];
+static uint32_t bc_ndirty;
+void *bc_owner;
+
+// Blocks picked off the dirty list to be written, in block order
+static uint32_t bc_flushq[NBCDIRTY];
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -24,6 +66,216 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Blocks that stay in the cache: the superblock and the bitmap, which
+// are used through the global pointers 'super' and 'bitmap'.
+static bool
+bc_pinned(uint32_t blockno)
+{
+    return !super ||
+        blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Drop a block from the cache to make room for another, writing it
+// back first if it is dirty.  Sweeps the CLOCK hand over the cached
+// blocks, giving each one that was accessed since the last sweep a
+// second chance.  Returns the slot the evicted block occupied.
+static uint32_t
+bc_evict(void)
+{
+    uint32_t n, slot;
+    void *addr;
+    int r;
+
+    // A dirty page cannot lose its accessed bit without losing its dirty
+    // bit too, so it is spared rather than cleared; after two full
+    // sweeps the next unpinned block goes regardless.
+    for (n = 0; ; n++) {
+        slot = bc_hand;
+        bc_hand = (bc_hand + 1) % bc_nslots;
+        addr = diskaddr(bc_slots[slot]);
+        if (!va_is_mapped(addr))
+            return slot;
+        // Blocks waiting for the journal may not be written in place
+        if (bc_pinned(bc_slots[slot]) || (va_is_dirty(addr) &&
+                    !journal_in_place(bc_slots[slot]))) {
+            if (n > 3 * bc_nslots)
+                panic("block cache budget %d too small", bc_budget);
+            continue;
+        }
+        if (n < 2 * bc_nslots && (uvpt[PGNUM(addr)] & PTE_A)) {
+            if (!va_is_dirty(addr) && (r = sys_page_map(0, addr, 0, addr,
+                            uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+                panic("in bc_evict, sys_page_map: %e", r);
+            continue;
+        }
+        break;
+    }
+
+    if (va_is_dirty(addr)) {
+        flush_block(addr);
+        fs_stats.st_bc_writebacks++;
+    }
+    if ((r = sys_page_unmap(0, addr)) < 0)
+        panic("in bc_evict, sys_page_unmap: %e", r);
+    fs_stats.st_bc_evictions++;
+    return slot;
+}
+
+// Record that blockno has just been brought into the cache, evicting
+// another block if the cache is full.
+static void
+bc_insert(uint32_t blockno)
+{
+    if (bc_nslots < MIN(bc_budget, BC_MAXSLOTS))
+        bc_slots[bc_nslots++] = blockno;
+    else
+        bc_slots[bc_evict()] = blockno;
+    fs_stats.st_bc_blocks = bc_nslots;
+}
+
+// Write the n cached blocks starting at blockno with one disk command,
+// then clear their dirty bits and the permission bits in clear.
+static void
+bc_write_run(uint32_t blockno, uint32_t n, int clear)
+{
+    uint32_t i;
+    void *addr;
+    int r;
+
+    if ((r = ide_write(blockno * BLKSECTS, diskaddr(blockno),
+                    n * BLKSECTS)) < 0)
+        panic("in bc_write_run, ide_write: %e", r);
+    for (i = 0; i < n; i++) {
+        addr = diskaddr(blockno + i);
+        if ((r = sys_page_map(0, addr, 0, addr,
+                        uvpt[PGNUM(addr)] & PTE_SYSCALL & ~clear)) < 0)
+            panic("in bc_write_run, sys_page_map: %e", r);
+    }
+    fs_stats.st_bc_writes++;
+    fs_stats.st_bc_blocks_written += n;
+}
+
+// Sort the n block numbers in a.
+static void
+bc_sort(uint32_t *a, uint32_t n)
+{
+    uint32_t gap, i, j, x;
+
+    for (gap = n / 2; gap > 0; gap /= 2)
+        for (i = gap; i < n; i++) {
+            x = a[i];
+            for (j = i; j >= gap && a[j - gap] > x; j -= gap)
+                a[j] = a[j - gap];
+            a[j] = x;
+        }
+}
+
+// Flush the listed blocks that belong to owner, or all of them if all
+// is set, and take them off the list.  The blocks are written in block
+// order, and runs of adjacent blocks go to the disk in one command.
+// Blocks waiting for the journal stay on the list unless force is set.
+static void
+bc_flush_dirty(void *owner, bool all, bool force)
+{
+    uint32_t i, j, n, m;
+    void *addr;
+    int r;
+
+    // Nothing may be brought into the cache, and so nothing evicted,
+    // between picking the blocks and writing them
+    bc_async_finish(true);
+
+    for (i = n = m = 0; i < bc_ndirty; i++) {
+        if ((!all && bc_dirty[i].d_owner != owner) ||
+                (!force && !journal_in_place(bc_dirty[i].d_blockno))) {
+            bc_dirty[n++] = bc_dirty[i];
+            continue;
+        }
+        // The block may have been evicted, and even be back, since it
+        // was listed
+        addr = diskaddr(bc_dirty[i].d_blockno);
+        if (!va_is_mapped(addr))
+            continue;
+        if (va_is_dirty(addr))
+            bc_flushq[m++] = bc_dirty[i].d_blockno;
+        else if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] &
+                        PTE_SYSCALL & ~(PTE_W | PTE_BC_DIRTY))) < 0)
+            panic("in bc_flush_dirty, sys_page_map: %e", r);
+    }
+    bc_ndirty = n;
+
+    bc_sort(bc_flushq, m);
+    for (i = 0; i < m; i = j) {
+        for (j = i + 1; j < m && j - i < BC_MAXRUN &&
+                 bc_flushq[j] == bc_flushq[j - 1] + 1; j++)
+            /* extend the run */;
+        bc_write_run(bc_flushq[i], j - i, PTE_W | PTE_BC_DIRTY);
+        // A block listed twice comes up again right after its run
+        while (j < m && bc_flushq[j] == bc_flushq[j - 1])
+            j++;
+    }
+}
+
+// Flush the dirty blocks written on behalf of owner, except those
+// waiting for the journal.
+void
+bc_flush_owner(void *owner)
+{
+    bc_flush_dirty(owner, false, false);
+}
+
+// Flush every dirty block.  With a journal this commits a transaction:
+// blocks the last commit left free go to their homes first, then the
+// rest go to the journal, and only then to their homes (see journal.c).
+void
+bc_sync(void)
+{
+    uint32_t i, m, n;
+    void *addr;
+
+    bc_flush_dirty(NULL, true, false);
+    for (i = m = 0; i < bc_ndirty; i++) {
+        addr = diskaddr(bc_dirty[i].d_blockno);
+        if (va_is_mapped(addr) && va_is_dirty(addr))
+            bc_flushq[m++] = bc_dirty[i].d_blockno;
+    }
+    if (m) {
+        bc_sort(bc_flushq, m);
+        for (i = 1, n = 1; i < m; i++)
+            if (bc_flushq[i] != bc_flushq[n - 1])
+                bc_flushq[n++] = bc_flushq[i];
+        if (journal_write(bc_flushq, n) < 0)
+            fs_stats.st_journal_overflows++;
+    }
+    bc_flush_dirty(NULL, true, true);
+}
+
+// Handle the first write to a cached block since it was last flushed.
+static void
+bc_mark_dirty(uint32_t blockno)
+{
+    void *addr = diskaddr(blockno);
+    int r;
+
+    if (!(uvpt[PGNUM(addr)] & PTE_BC_DIRTY)) {
+        // Only a list full of blocks waiting for the journal must be
+        // written out in the middle of a transaction
+        if (bc_ndirty == NBCDIRTY)
+            bc_flush_dirty(NULL, true, false);
+        if (bc_ndirty == NBCDIRTY) {
+            bc_sync();
+            fs_stats.st_journal_overflows++;
+        }
+        journal_dirty(blockno);
+        bc_dirty[bc_ndirty].d_blockno = blockno;
+        bc_dirty[bc_ndirty].d_owner = bc_owner;
+        bc_ndirty++;
+    }
+    if ((r = sys_page_map(0, addr, 0, addr, (uvpt[PGNUM(addr)] & PTE_SYSCALL) |
+                    PTE_W | PTE_BC_DIRTY)) < 0)
+        panic("in bc_mark_dirty, sys_page_map: %e", r);
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -42,18 +294,32 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
+    addr = ROUNDDOWN(addr, BLKSIZE);
+    if ((utf->utf_err & FEC_WR) && va_is_mapped(addr)) {
+        bc_mark_dirty(blockno);
+        return;
+    }
+
+    // The disk is ours only once the background read is done,
+    // which may bring in this very block.
+    bc_async_finish(true);
+    if (va_is_mapped(addr))
+        return;
+
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
-    addr = ROUNDDOWN(addr, BLKSIZE);
     sys_page_alloc(0, addr, PTE_U | PTE_W | PTE_P);
     ide_read(blockno * BLKSECTS, addr, BLKSECTS);
+    fs_stats.st_bc_reads++;
+    fs_stats.st_bc_blocks_read++;
     if (bitmap)
-        bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+        mark_block_used(blockno);
 
 	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+	// block from disk, and map it read-only until it is written
+	if ((r = sys_page_map(0, addr, 0, addr, PTE_U | PTE_P)) < 0)
 		panic("in bc_pgfault, sys_page_map: %e", r);
+    bc_insert(blockno);
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
@@ -63,7 +329,8 @@ bc_pgfault(struct UTrapframe *utf)
 }
 
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
+// necessary, then clear the PTE_D bit using sys_page_map, mapping the
+// page read-only so the next write puts it back on the dirty list.
 // If the block is not in the block cache or is not dirty, does
 // nothing.
 void
@@ -75,10 +342,156 @@ flush_block(void *addr)
 		panic("flush_block of bad va %08x", addr);
 
     if (va_is_mapped(addr) && va_is_dirty(addr)) {
-        addr = ROUNDDOWN(addr, BLKSIZE);
-        ide_write(blockno * BLKSECTS, addr, BLKSECTS);
-        sys_page_map(0, addr, 0, addr, PTE_SYSCALL);
+        // Finishing a background read may evict this very block
+        bc_async_finish(true);
+        if (va_is_mapped(addr) && va_is_dirty(addr) &&
+                journal_in_place(blockno))
+            bc_write_run(blockno, 1, PTE_W);
+    }
+}
+
+// Note that blockno is being read ahead of its use.
+static void
+bc_ra_mark(uint32_t blockno)
+{
+    if (ra_ring[ra_next])
+        fs_stats.st_ra_waste++;
+    ra_ring[ra_next] = blockno;
+    ra_next = (ra_next + 1) % NRA;
+    fs_stats.st_ra_blocks++;
+}
+
+// Note that blockno is being read; count a hit if it was read ahead.
+void
+bc_ra_use(uint32_t blockno)
+{
+    int i;
+
+    for (i = 0; i < NRA; i++)
+        if (ra_ring[i] == blockno) {
+            ra_ring[i] = 0;
+            fs_stats.st_ra_hits++;
+            return;
+        }
+}
+
+// How many of the n blocks starting at blockno can be read with one
+// disk command: the run stops at the first block already cached.
+static uint32_t
+bc_run_length(uint32_t blockno, uint32_t n)
+{
+    uint32_t i;
+
+    n = MIN(n, BC_MAXRUN);
+    if (super)
+        n = MIN(n, super->s_nblocks - blockno);
+    for (i = 0; i < n; i++)
+        if (va_is_mapped(diskaddr(blockno + i)))
+            break;
+    return i;
+}
+
+// Read up to n contiguous blocks starting at blockno into the cache
+// with a single disk command, stopping at the first one that is
+// already cached.  Returns the number of blocks read.
+int
+bc_read_run(uint32_t blockno, uint32_t n)
+{
+    uint32_t i;
+    int r;
+
+    bc_async_finish(true);
+    n = bc_run_length(blockno, n);
+    for (i = 0; i < n; i++)
+        if ((r = sys_page_alloc(0, diskaddr(blockno + i),
+                        PTE_U | PTE_W | PTE_P)) < 0)
+            panic("in bc_read_run, sys_page_alloc: %e", r);
+    if (n && (r = ide_read(blockno * BLKSECTS, diskaddr(blockno),
+                    n * BLKSECTS)) < 0)
+        panic("in bc_read_run, ide_read: %e", r);
+    if (n) {
+        fs_stats.st_bc_reads++;
+        fs_stats.st_bc_blocks_read += n;
+    }
+
+    // Clear the dirty bits left by the read
+    for (i = 0; i < n; i++) {
+        if ((r = sys_page_map(0, diskaddr(blockno + i), 0,
+                        diskaddr(blockno + i), PTE_U | PTE_P)) < 0)
+            panic("in bc_read_run, sys_page_map: %e", r);
+        if (bitmap)
+            mark_block_used(blockno + i);
+        bc_insert(blockno + i);
+    }
+    return n;
+}
+
+// Make sure the n contiguous blocks starting at blockno are in the cache
+// without waiting for the disk.  If blockno is not cached, start reading
+// it and the uncached blocks after it in the background, unless another
+// read is already in flight.  Blocks from the ra'th on are being read
+// ahead of their use.  Returns 1 if blockno is cached (or could only be
+// read synchronously, which has been done), or 0 if the caller should
+// try again after bc_async_finish.
+int
+bc_read_async(uint32_t blockno, uint32_t n, uint32_t ra)
+{
+    uint32_t i;
+    int r;
+
+    if (va_is_mapped(diskaddr(blockno)))
+        return 1;
+    if (async_nblocks)
+        return 0;
+
+    n = bc_run_length(blockno, n);
+    for (i = ra; i < n; i++)
+        bc_ra_mark(blockno + i);
+    for (i = 0; i < n; i++)
+        if ((r = sys_page_alloc(0, (void*) BCSTAGE + i * PGSIZE,
+                        PTE_U | PTE_W | PTE_P)) < 0)
+            panic("in bc_read_async, sys_page_alloc: %e", r);
+    if (ide_read_start(blockno * BLKSECTS, (void*) BCSTAGE,
+                n * BLKSECTS) < 0) {
+        for (i = 0; i < n; i++)
+            sys_page_unmap(0, (void*) BCSTAGE + i * PGSIZE);
+        bc_read_run(blockno, n);
+        return 1;
+    }
+    async_blockno = blockno;
+    async_nblocks = n;
+    fs_stats.st_bc_reads++;
+    fs_stats.st_bc_blocks_read += n;
+    return 0;
+}
+
+// Install the blocks read in the background in the cache once they have
+// arrived.  If wait is false and they have not arrived yet, do nothing.
+void
+bc_async_finish(bool wait)
+{
+    void *addr;
+    uint32_t i;
+    int r, ok;
+
+    if (!async_nblocks || (!wait && !ide_read_done()))
+        return;
+
+    // On a disk error, leave the blocks to be read again synchronously
+    ok = ide_finish() == 0;
+    for (i = 0; i < async_nblocks; i++) {
+        addr = diskaddr(async_blockno + i);
+        if (ok && !va_is_mapped(addr)) {
+            if ((r = sys_page_map(0, (void*) BCSTAGE + i * PGSIZE, 0, addr,
+                            PTE_U | PTE_P)) < 0)
+                panic("in bc_async_finish, sys_page_map: %e", r);
+            if (bitmap)
+                mark_block_used(async_blockno + i);
+            bc_insert(async_blockno + i);
+        }
+        sys_page_unmap(0, (void*) BCSTAGE + i * PGSIZE);
     }
+    async_nblocks = 0;
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -115,6 +528,7 @@ void
 bc_init(void)
 {
 	struct Super super;
+	fs_stats.st_bc_budget = bc_budget;
 	set_pgfault_handler(bc_pgfault);
 	check_bc();
 
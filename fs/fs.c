@@ -1,3 +1,4 @@
+#include <inc/x86.h>
 #include <inc/string.h>
 #include <inc/partition.h>
 
@@ -36,14 +37,234 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
-// Mark a block free in the bitmap
+// Free-space summary layered over the on-disk bitmap.  Bit w of
+// bitmap_summary is set iff bitmap word w still has a free block, so
+// alloc_block can skip 32 fully-allocated words at a time, and
+// bitmap_nfree counts the free blocks covered by each bitmap block.
+// None of this is stored on disk: fs_init rebuilds it at mount time.
+#define NBITMAPWORDS	(DISKSIZE / BLKSIZE / 32)
+#define NBITMAPBLKS	(DISKSIZE / BLKSIZE / BLKBITSIZE)
+
+static uint32_t bitmap_summary[NBITMAPWORDS / 32];
+static uint32_t bitmap_nfree[NBITMAPBLKS];
+static uint32_t bitmap_cursor;	// bitmap word where the next search starts
+
+// Bits of bitmap word 'w' that describe blocks which actually exist.
+static uint32_t
+bitmap_word_mask(uint32_t w)
+{
+    uint32_t nblocks = super->s_nblocks;
+    if (w * 32 + 32 <= nblocks)
+        return ~0;
+    if (w * 32 >= nblocks)
+        return 0;
+    return (1 << (nblocks % 32)) - 1;
+}
+
+// Recompute the summary bit for bitmap word 'w'.
+static void
+bitmap_summary_update(uint32_t w)
+{
+    if (bitmap[w] & bitmap_word_mask(w))
+        bitmap_summary[w / 32] |= 1 << (w % 32);
+    else
+        bitmap_summary[w / 32] &= ~(1 << (w % 32));
+}
+
+// Rebuild the free-space summary from the bitmap.
+void
+bitmap_rebuild(void)
+{
+    uint32_t w, nwords = (super->s_nblocks + 31) / 32;
+
+    memset(bitmap_summary, 0, sizeof(bitmap_summary));
+    memset(bitmap_nfree, 0, sizeof(bitmap_nfree));
+    for (w = 0; w < nwords; w++) {
+        uint32_t bits = bitmap[w] & bitmap_word_mask(w);
+        bitmap_summary_update(w);
+        for (; bits; bits &= bits - 1)
+            bitmap_nfree[w * 32 / BLKBITSIZE]++;
+    }
+    bitmap_cursor = 0;
+}
+
+// Return the number of free blocks on the disk.
+uint32_t
+bitmap_free_count(void)
+{
+    uint32_t i, n = 0;
+    for (i = 0; i * BLKBITSIZE < super->s_nblocks; i++)
+        n += bitmap_nfree[i];
+    return n;
+}
+
+// Mark a block in use in the bitmap, keeping the summary up to date.
+void
+mark_block_used(uint32_t blockno)
+{
+    uint32_t w = blockno / 32;
+    if (!(bitmap[w] & (1 << (blockno % 32))))
+        return;
+    bitmap[w] &= ~(1 << (blockno % 32));
+    bitmap_nfree[blockno / BLKBITSIZE]--;
+    bitmap_summary_update(w);
+}
+
+// --------------------------------------------------------------
+// Shared blocks
+// --------------------------------------------------------------
+
+// Return the reference count table entry of blockno, or NULL if the
+// file system has no table.
+static uint16_t *
+block_refent(uint32_t blockno)
+{
+    if (!super->s_nrefmap)
+        return NULL;
+    return (uint16_t *) diskaddr(super->s_refmap + blockno / BLKREFS) +
+        blockno % BLKREFS;
+}
+
+// Return the number of references to blockno beyond the first.
+uint32_t
+block_refs(uint32_t blockno)
+{
+    uint16_t *ref = block_refent(blockno);
+    return ref ? *ref & REF_COUNT : 0;
+}
+
+// Add a reference to blockno.  Returns 0 on success, or -E_NO_MEM if
+// it has as many references as it can count.
+int
+block_ref(uint32_t blockno)
+{
+    uint16_t *ref = block_refent(blockno);
+    if (!ref || (*ref & REF_COUNT) == REF_COUNT)
+        return -E_NO_MEM;
+    (*ref)++;
+    return 0;
+}
+
+// FNV-1a, a word at a time.
+uint32_t
+block_fingerprint(const void *blk)
+{
+    const uint32_t *w = blk;
+    uint32_t h = 2166136261;
+    int i;
+
+    for (i = 0; i < BLKSIZE / 4; i++)
+        h = (h ^ w[i]) * 16777619;
+    return h;
+}
+
+// Return the i'th fingerprint table slot.
+static struct FpEntry *
+fp_slot(uint32_t i)
+{
+    struct FpEntry *fe;
+
+    i %= super->s_nfpmap * BLKFPS;
+    fe = diskaddr(super->s_fpmap + i / BLKFPS);
+    return &fe[i % BLKFPS];
+}
+
+// Drop blockno, which is about to be freed, from the fingerprint table.
+static void
+fp_forget(uint32_t blockno)
+{
+    uint32_t fp = block_fingerprint(diskaddr(blockno));
+    struct FpEntry *fe;
+    int i;
+
+    for (i = 0; i < FP_WINDOW; i++) {
+        fe = fp_slot(fp + i);
+        if (fe->fe_blockno == blockno)
+            fe->fe_blockno = 0;
+    }
+}
+
+// Drop one reference to blockno.  Returns true if others remain, so
+// that the block must not be freed.
+static bool
+block_unref(uint32_t blockno)
+{
+    uint16_t *ref = block_refent(blockno);
+
+    if (!ref || !*ref)
+        return false;
+    // A count that reached its limit is no longer exact: keep it
+    if ((*ref & REF_COUNT) == REF_COUNT)
+        return true;
+    if (*ref & REF_COUNT) {
+        (*ref)--;
+        return true;
+    }
+    fp_forget(blockno);
+    *ref = 0;
+    return false;
+}
+
+// The reference count of a version index block counts the File
+// structures leading to the history it indexes beyond the first: when
+// a directory copies a data block on write, the old version of the
+// directory keeps a stale copy of each File structure in the block.
+// Add those references for the directory block blockno.
+static void
+dir_block_ref(uint32_t blockno)
+{
+    struct File *f = diskaddr(blockno);
+    int i;
+
+    for (i = 0; i < BLKFILES; i++)
+        if (f[i].f_name[0] && f[i].f_vindex)
+            block_ref(f[i].f_vindex);
+}
+
+// Drop a reference to a block, and mark it free in the bitmap if that
+// was the last one.
 void
 free_block(uint32_t blockno)
 {
-	// Blockno zero is the null pointer of block numbers.
-	if (blockno == 0)
-		panic("attempt to free zero block");
-	bitmap[blockno/32] |= 1<<(blockno%32);
+    // Blockno zero is the null pointer of block numbers.
+    if (blockno == 0)
+        panic("attempt to free zero block");
+    if (block_is_free(blockno) || block_unref(blockno))
+        return;
+    // A client may have the page mapped (see file_map_block): leave it
+    // the old contents, and give the block a new page when it is reused
+    if (va_is_mapped(diskaddr(blockno)) && pageref(diskaddr(blockno)) > 1)
+        sys_page_unmap(0, diskaddr(blockno));
+    bitmap[blockno/32] |= 1<<(blockno%32);
+    bitmap_nfree[blockno / BLKBITSIZE]++;
+    bitmap_summary_update(blockno / 32);
+}
+
+// Find a free block and mark it in use, without flushing the bitmap.
+// The search starts at the word where the last one succeeded and uses
+// the summary to skip full words, so it is amortized O(1) even when
+// the disk is nearly full.
+//
+// Return block number allocated on success,
+// -E_NO_DISK if we are out of blocks.
+int
+claim_free_block(void)
+{
+    uint32_t nwords = (super->s_nblocks + 31) / 32;
+    uint32_t nsummary = (nwords + 31) / 32;
+    uint32_t i, s, w, blockno;
+
+    s = bitmap_cursor / 32;
+    for (i = 0; i <= nsummary; i++, s = (s + 1) % nsummary) {
+        if (!bitmap_summary[s])
+            continue;
+        w = s * 32 + __builtin_ctz(bitmap_summary[s]);
+        blockno = w * 32 + __builtin_ctz(bitmap[w] & bitmap_word_mask(w));
+        mark_block_used(blockno);
+        bitmap_cursor = w;
+        return blockno;
+    }
+    return -E_NO_DISK;
 }
 
 // Search the bitmap for a free block and allocate it.  When you
@@ -58,15 +279,37 @@ alloc_block(void)
 	// The bitmap consists of one or more blocks.  A single bitmap block
 	// contains the in-use bits for BLKBITSIZE blocks.  There are
 	// super->s_nblocks blocks in the disk altogether.
-    uint32_t blockno;
-    for (blockno = 0; blockno < super->s_nblocks; blockno++)
-        if (block_is_free(blockno)) {
-            bitmap[blockno / 32] &= ~(1 << (blockno % 32));
-            flush_block(diskaddr(blockno));
-            return blockno;
-        }
+    int blockno = claim_free_block();
+    if (blockno < 0)
+        return blockno;
+    flush_block(&bitmap[blockno / 32]);
+    return blockno;
+}
 
-	return -E_NO_DISK;
+// Like alloc_block, but take block goal if it is free, or else the
+// first free block in the rest of its bitmap word or the next, so that
+// a file written in order is laid out in runs that can be read with a
+// single disk command.  A goal of 0 means anywhere will do.
+int
+alloc_block_near(uint32_t goal)
+{
+    uint32_t w, bits, blockno;
+
+    if (!goal || goal >= super->s_nblocks)
+        return alloc_block();
+    w = goal / 32;
+    bits = bitmap[w] & bitmap_word_mask(w) & ~((1 << (goal % 32)) - 1);
+    if (!bits && ++w < (super->s_nblocks + 31) / 32)
+        bits = bitmap[w] & bitmap_word_mask(w);
+    if (!bits)
+        return alloc_block();
+
+    blockno = w * 32 + __builtin_ctz(bits);
+    mark_block_used(blockno);
+    flush_block(&bitmap[blockno / 32]);
+    if (blockno == goal)
+        fs_stats.st_alloc_near++;
+    return blockno;
 }
 
 // Validate the file system bitmap.
@@ -111,18 +354,40 @@ fs_init(void)
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+    journal_init();
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
-	
+    bitmap_rebuild();
+}
+
+// Set *pind to the indirect block whose number is in the slot at
+// *pblockno.  When 'alloc' is set and there is none, allocate a zeroed
+// one; otherwise return -E_NOT_FOUND.
+static int
+indirect_walk(uint32_t *pblockno, bool alloc, uint32_t **pind)
+{
+    if (!*pblockno) {
+        if (!alloc)
+            return -E_NOT_FOUND;
+
+        int blockno = alloc_block();
+        if (blockno < 0)
+            return blockno;
+        memset(diskaddr(blockno), 0, BLKSIZE);
+        *pblockno = blockno;
+    }
+    *pind = diskaddr(*pblockno);
+    return 0;
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// The slot will be one of the f->f_direct[] entries, an entry in the
+// indirect block, or an entry in one of the indirect blocks that the
+// double-indirect block points to.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -130,37 +395,439 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= MAXFILEBLKS).
 //
 // Analogy: This is like pgdir_walk for files.
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
+    uint32_t *ind, b;
+    int r;
+
+    // The indirect pointers are members of the packed struct File, so
+    // indirect_walk works on a copy that is written back if it changed
     if (filebno < NDIRECT) {
         *ppdiskbno = &f->f_direct[filebno];
     } else if (filebno < NDIRECT + NINDIRECT) {
-        // Allocate indirect block if necessary
-        if (!f->f_indirect) {
-            if (!alloc)
-                return -E_NOT_FOUND;
+        b = f->f_indirect;
+        r = indirect_walk(&b, alloc, &ind);
+        if (b != f->f_indirect)
+            f->f_indirect = b;
+        if (r < 0)
+            return r;
+        *ppdiskbno = &ind[filebno - NDIRECT];
+    } else if (filebno < MAXFILEBLKS) {
+        // The double-indirect block points to indirect blocks
+        filebno -= NDIRECT + NINDIRECT;
+        b = f->f_dindirect;
+        r = indirect_walk(&b, alloc, &ind);
+        if (b != f->f_dindirect)
+            f->f_dindirect = b;
+        if (r < 0 ||
+                (r = indirect_walk(&ind[filebno / NINDIRECT], alloc, &ind)) < 0)
+            return r;
+        *ppdiskbno = &ind[filebno % NINDIRECT];
+    } else {
+        return -E_INVAL;
+    }
 
-            int blockno = alloc_block();
-            if (blockno < 0)
-                return blockno;
-            f->f_indirect = blockno;
-            memset(diskaddr(blockno), 0, BLKSIZE);
+    return 0;
+}
+
+// Return the number of the indirect block holding version v's pointer
+// to its i'th block, or 0 if the pointer is in v itself or v has no
+// such indirect block.  A pointer can only change without changing the
+// versions that share its indirect block when that block is v's alone.
+static uint32_t
+version_ind(struct File *v, uint32_t i)
+{
+    uint32_t *l1;
+
+    if (!v || i < NDIRECT || i >= MAXFILEBLKS)
+        return 0;
+    if (i < NDIRECT + NINDIRECT)
+        return v->f_indirect;
+    if (!v->f_dindirect)
+        return 0;
+    l1 = diskaddr(v->f_dindirect);
+    return l1[(i - NDIRECT - NINDIRECT) / NINDIRECT];
+}
+
+// --------------------------------------------------------------
+// Delta blocks
+// --------------------------------------------------------------
+
+// When the head of a regular file copies a block it shares with the
+// previous version, that version is left as the only user of the old
+// block.  If the old block differs from the same block of the version
+// before it by little enough, it is replaced by a delta record against
+// that block and freed (see inc/fs.h).  Rebuilding a block may take a
+// chain of deltas back through older versions, at most DELTA_MAXCHAIN
+// long; a record bigger than DELTA_MAXSIZE is not worth keeping.
+#define DELTA_MAXCHAIN	4
+#define DELTA_MAXSIZE	(BLKSIZE / 4)
+
+// Rebuilt blocks are kept in a small pool of pages, tagged with the
+// block pointer they were rebuilt for.
+#define DELTAMAP	0xE0100000
+#define NDELTAPAGES	16
+
+bool delta_enabled = true;
+
+static uint32_t delta_tags[NDELTAPAGES];
+static int delta_next;
+static uint32_t delta_pack;	// pack block records are added to, or 0
+
+static struct DeltaRec *
+delta_rec(uint32_t ptr)
+{
+    struct DeltaPack *pk = diskaddr(DELTA_PACK(ptr));
+    return (struct DeltaRec *) ((char *) pk + pk->dp_off[DELTA_SLOT(ptr)]);
+}
+
+// Set *blk to the filebno'th block of f, whose block pointer is the
+// delta record ptr, rebuilding it if it is not in the pool already.
+// Returns 0 on success, < 0 on error.
+static int
+delta_read(struct File *f, uint32_t filebno, uint32_t ptr, char **blk)
+{
+    struct DeltaRec *dr;
+    struct DeltaOp *op;
+    uint32_t *pbase;
+    uint64_t start;
+    char *base, *page;
+    bool lz;
+    int i, r;
+
+    for (i = 0; i < NDELTAPAGES; i++)
+        if (delta_tags[i] == ptr) {
+            *blk = (char *) DELTAMAP + i * PGSIZE;
+            return 0;
         }
 
-        // Get correct entry of indirect block
-        uint32_t *indirect = diskaddr(f->f_indirect);
-        *ppdiskbno = &indirect[filebno - NDIRECT];
-    } else {
-        return -E_INVAL;
+    // The base is the same block of the next version, or zeroes.
+    // A compressed block has none.
+    lz = delta_rec(ptr)->dr_flags & DR_LZ;
+    base = NULL;
+    if (!lz && f->f_next_file &&
+            file_block_walk(f->f_next_file, filebno, &pbase, 0) == 0 &&
+            *pbase) {
+        if (!BLKPTR_ISDELTA(*pbase))
+            base = diskaddr(*pbase);
+        else if ((r = delta_read(f->f_next_file, filebno, *pbase, &base)) < 0)
+            return r;
+    }
+
+    i = delta_next;
+    if ((char *) DELTAMAP + i * PGSIZE == base)
+        i = (i + 1) % NDELTAPAGES;
+    delta_next = (i + 1) % NDELTAPAGES;
+    page = (char *) DELTAMAP + i * PGSIZE;
+    if (!va_is_mapped(page) &&
+            (r = sys_page_alloc(0, page, PTE_P | PTE_U | PTE_W)) < 0)
+        return r;
+    delta_tags[i] = 0;
+
+    dr = delta_rec(ptr);
+    if (lz) {
+        start = read_tsc();
+        if (lz_decompress(dr + 1, dr->dr_len - sizeof(*dr), page) != BLKSIZE)
+            return -E_INVAL;
+        fs_stats.st_lz_reads++;
+        fs_stats.st_lz_read_cycles += read_tsc() - start;
+        delta_tags[i] = ptr;
+        *blk = page;
+        return 0;
+    }
+
+    if (base)
+        memmove(page, base, BLKSIZE);
+    else
+        memset(page, 0, BLKSIZE);
+    for (op = (struct DeltaOp *) (dr + 1);
+            (char *) op < (char *) dr + dr->dr_len;
+            op = (struct DeltaOp *) ((char *) (op + 1) + op->do_len))
+        memmove(page + op->do_off, op + 1, op->do_len);
+
+    delta_tags[i] = ptr;
+    *blk = page;
+    return 0;
+}
+
+// Encode blk as a delta record against base (zeroes if NULL) in buf,
+// of at most max bytes.  Changed ranges separated by fewer equal bytes
+// than an op header takes are merged.  Returns the record's size, or
+// -1 if it would not fit.
+static int
+delta_diff(const uint8_t *base, const uint8_t *blk, uint8_t *buf, int max)
+{
+    struct DeltaRec *dr = (struct DeltaRec *) buf;
+    struct DeltaOp *op;
+    int i, j, end, n;
+
+#define BASE(i)	(base ? base[i] : 0)
+    n = sizeof(struct DeltaRec);
+    for (i = 0; i < BLKSIZE; ) {
+        if (BASE(i) == blk[i]) {
+            i++;
+            continue;
+        }
+        for (end = j = i + 1; j < BLKSIZE; j++)
+            if (BASE(j) != blk[j])
+                end = j + 1;
+            else if (j - end >= (int) sizeof(struct DeltaOp))
+                break;
+        if (n + (int) sizeof(struct DeltaOp) + end - i > max)
+            return -1;
+        op = (struct DeltaOp *) (buf + n);
+        op->do_off = i;
+        op->do_len = end - i;
+        memmove(op + 1, blk + i, end - i);
+        n += sizeof(struct DeltaOp) + end - i;
+        i = end;
+    }
+#undef BASE
+    dr->dr_len = n;
+    return n;
+}
+
+// Add a record of len bytes to the current pack block, starting a new
+// one if it is full, and set *ptr to the block pointer naming it.
+// Returns 0 on success, < 0 on error.
+static int
+delta_store(const void *rec, int len, uint32_t *ptr)
+{
+    struct DeltaPack *pk = NULL;
+    int r;
+
+    if (delta_pack)
+        pk = diskaddr(delta_pack);
+    if (!pk || pk->dp_nrecs == NDELTASLOTS || pk->dp_free + len > BLKSIZE) {
+        if ((r = alloc_block()) < 0)
+            return r;
+        if (pk && !pk->dp_nlive)
+            free_block(delta_pack);
+        delta_pack = r;
+        pk = diskaddr(delta_pack);
+        memset(pk, 0, BLKSIZE);
+        pk->dp_free = sizeof(struct DeltaPack);
     }
 
+    pk->dp_off[pk->dp_nrecs] = pk->dp_free;
+    memmove((char *) pk + pk->dp_free, rec, len);
+    pk->dp_free += len;
+    *ptr = DELTA_PTR(delta_pack, pk->dp_nrecs);
+    pk->dp_nrecs++;
+    pk->dp_nlive++;
     return 0;
 }
 
+// Drop record ptr, which no version uses any more, and free its pack
+// block once none of the records in it are used.
+static void
+delta_release(uint32_t ptr)
+{
+    struct DeltaPack *pk = diskaddr(DELTA_PACK(ptr));
+    int i;
+
+    for (i = 0; i < NDELTAPAGES; i++)
+        if (delta_tags[i] == ptr)
+            delta_tags[i] = 0;
+    if (pk->dp_nlive && --pk->dp_nlive == 0 && DELTA_PACK(ptr) != delta_pack)
+        free_block(DELTA_PACK(ptr));
+}
+
+// Try to replace the filebno'th block of version v, which no other
+// version uses, with a delta against the same block of the version
+// before it.
+static void
+delta_encode(struct File *v, uint32_t filebno)
+{
+    static uint8_t buf[DELTA_MAXSIZE];
+    struct File *older = v->f_next_file;
+    uint32_t *p, *pbase, oldbno;
+    char *base;
+    int depth, len;
+
+    if (!delta_enabled || v->f_type != FTYPE_REG || !older)
+        return;
+    if (file_block_walk(v, filebno, &p, 0) < 0 || !*p || BLKPTR_ISDELTA(*p))
+        return;
+    // The pointer itself must belong to v alone
+    if (filebno >= NDIRECT &&
+            version_ind(v, filebno) == version_ind(older, filebno))
+        return;
+
+    base = NULL;
+    depth = 1;
+    if (file_block_walk(older, filebno, &pbase, 0) == 0 && *pbase) {
+        if (*pbase == *p)
+            return;
+        if (BLKPTR_ISDELTA(*pbase)) {
+            depth += delta_rec(*pbase)->dr_depth;
+            if (depth > DELTA_MAXCHAIN ||
+                    delta_read(older, filebno, *pbase, &base) < 0) {
+                fs_stats.st_delta_full++;
+                return;
+            }
+        } else
+            base = diskaddr(*pbase);
+    }
+
+    len = delta_diff((uint8_t *) base, diskaddr(*p), buf, sizeof(buf));
+    if (len < 0) {
+        fs_stats.st_delta_full++;
+        return;
+    }
+    ((struct DeltaRec *) buf)->dr_depth = depth;
+
+    oldbno = *p;
+    if (delta_store(buf, len, p) < 0)
+        return;
+    free_block(oldbno);
+    fs_stats.st_delta_blocks++;
+    fs_stats.st_delta_bytes += len;
+}
+
+// Old blocks that delta_encode leaves whole are compressed later, a
+// few at a time between requests (see fs_compact), into records in the
+// same pack blocks as deltas.  copy_block queues each block the head
+// stops using; if the queue is full the block just stays whole.  A
+// record bigger than LZ_MAXSIZE is not worth keeping.
+#define NCOMPACT	256
+#define LZ_MAXSIZE	(BLKSIZE * 3 / 4)
+
+bool compact_enabled = true;
+
+static struct Compact {
+    struct File *c_file;	// head of the file
+    struct File *c_version;	// version the head left using the block
+    uint32_t c_filebno;
+} compact_queue[NCOMPACT];
+static uint32_t compact_head, compact_tail;
+
+static void
+compact_add(struct File *f, uint32_t filebno)
+{
+    struct Compact *c;
+
+    if (!compact_enabled || f->f_type != FTYPE_REG || !f->f_next_file ||
+            compact_tail - compact_head == NCOMPACT)
+        return;
+    c = &compact_queue[compact_tail++ % NCOMPACT];
+    c->c_file = f;
+    c->c_version = f->f_next_file;
+    c->c_filebno = filebno;
+}
+
+// Compress the block c's version uses, if no head uses it, and point
+// every version using it at the compressed record instead.
+static void
+compact_block(struct Compact *c)
+{
+    static uint8_t buf[sizeof(struct DeltaRec) + LZ_MAXSIZE];
+    struct DeltaRec *dr = (struct DeltaRec *) buf;
+    struct File *v;
+    uint32_t *p, raw, ptr;
+    bool found;
+    int len;
+
+    // Since it was queued the block may have been turned into a delta,
+    // the head may share it again (see dedup_block), or the version may
+    // have been dropped (see version_drop).
+    if (!c->c_version ||
+            file_block_walk(c->c_version, c->c_filebno, &p, 0) < 0)
+        return;
+    raw = *p;
+    if (!raw || BLKPTR_ISDELTA(raw) || block_is_free(raw) || block_refs(raw))
+        return;
+    if (file_block_walk(c->c_file, c->c_filebno, &p, 0) == 0 && *p == raw)
+        return;
+
+    len = lz_compress(diskaddr(raw), dr + 1, LZ_MAXSIZE);
+    if (len < 0) {
+        fs_stats.st_lz_full++;
+        return;
+    }
+    len += sizeof(*dr);
+    dr->dr_len = len;
+    dr->dr_depth = 0;
+    dr->dr_flags = DR_LZ;
+    bc_owner = c->c_file;
+    if (delta_store(buf, len, &ptr) < 0)
+        return;
+
+    // The versions using raw are consecutive from c's version on, since
+    // a newer one would have shared it through its reference count, and
+    // may share indirect blocks, so stop at the first one not using it.
+    found = false;
+    for (v = c->c_version; v; v = v->f_next_file) {
+        if (file_block_walk(v, c->c_filebno, &p, 0) < 0 || *p != raw)
+            break;
+        *p = ptr;
+        found = true;
+    }
+    if (!found) {
+        delta_release(ptr);
+        return;
+    }
+    free_block(raw);
+    fs_stats.st_lz_blocks++;
+    fs_stats.st_lz_bytes += len;
+}
+
+// Forget the queued blocks of head f, which is being removed: its
+// File structure may be reused before they come up.
+static void
+compact_forget(struct File *f)
+{
+    int i;
+
+    for (i = 0; i < NCOMPACT; i++)
+        if (compact_queue[i].c_file == f)
+            compact_queue[i].c_version = NULL;
+}
+
+// Compress up to n of the queued old blocks.
+// Returns the number of blocks still queued.
+int
+fs_compact(int n)
+{
+    while (n-- > 0 && compact_head != compact_tail)
+        compact_block(&compact_queue[compact_head++ % NCOMPACT]);
+    return compact_tail - compact_head;
+}
+
+// Return the best place for a new filebno'th block of f: right after
+// the block before it, if that is an ordinary block, or else 0.
+static uint32_t
+file_block_goal(struct File *f, uint32_t filebno)
+{
+    uint32_t *p;
+
+    if (filebno == 0 || file_block_walk(f, filebno - 1, &p, 0) < 0 ||
+            !*p || BLKPTR_ISDELTA(*p))
+        return 0;
+    return *p + 1;
+}
+
+// Return how many of the blocks of f from the filebno'th on, up to max,
+// are ordinary blocks that follow the filebno'th one contiguously on
+// disk; the filebno'th must itself be an ordinary block.
+static uint32_t
+file_block_run(struct File *f, uint32_t filebno, uint32_t max)
+{
+    uint32_t n, *p, *pnext;
+
+    if (file_block_walk(f, filebno, &p, 0) < 0)
+        return 0;
+    for (n = 1; n < max; n++)
+        if (file_block_walk(f, filebno + n, &pnext, 0) < 0 ||
+                *pnext != *p + n)
+            break;
+    return n;
+}
+
 // Set *ppdiskbno to the pointer to the block in memory
 // where the filebno'th block of file 'f' would be mapped.
 //
@@ -174,9 +841,11 @@ file_get_diskbno(struct File *f, uint32_t filebno, uint32_t **ppdiskbno) {
         return result;
 
     if (**ppdiskbno == 0) {
-        int blockno = alloc_block();
+        int blockno = alloc_block_near(file_block_goal(f, filebno));
         if (blockno < 0)
             return blockno;
+        // Freed blocks are reused, so don't let old contents show
+        memset(diskaddr(blockno), 0, BLKSIZE);
         **ppdiskbno = blockno;
     }
 
@@ -196,30 +865,276 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
     int r = file_get_diskbno(f, filebno, &diskbno);
     if (r < 0)
         return r;
+    if (BLKPTR_ISDELTA(*diskbno))
+        return delta_read(f, filebno, *diskbno, blk);
     *blk = diskaddr(*diskbno);
     return 0;
 }
 
+static void flush_queue_move(uint32_t oldbno, uint32_t newbno);
+static void flush_queue_settle(struct File *f);
+
 // Copies blk to a newly allocated block.
 int
 copy_block(struct File *f, int i, uint32_t *diskbno)
 {
+    uint32_t *next_diskbno = NULL;
+    uint32_t oldbno;
+    bool shared;
     int r;
 
     // if diskbno is the same as diskbno of previous file, copy block.
-    if (f->f_next_file) {
-        uint32_t *next_diskbno;
-        if ((r = file_get_diskbno(f->f_next_file, i, &next_diskbno)) < 0)
+    // Look the previous version up without allocating: it is immutable.
+    if (f->f_next_file &&
+            (r = file_block_walk(f->f_next_file, i, &next_diskbno, 0)) < 0) {
+        if (r != -E_NOT_FOUND)
+            return r;
+        next_diskbno = NULL;
+    }
+    shared = next_diskbno && *diskbno == *next_diskbno;
+
+    // A block that dedup_block shared with other files is copied too.
+    if (shared || block_refs(*diskbno)) {
+        int new_blockno = alloc_block_near(file_block_goal(f, i));
+        if (new_blockno < 0)
+            return new_blockno;
+        void *blk = ROUNDDOWN(diskaddr(*diskbno), BLKSIZE);
+        memcpy(diskaddr(new_blockno), blk, BLKSIZE);
+        oldbno = *diskbno;
+        *diskbno = new_blockno;
+        if (f->f_type == FTYPE_DIR && i < f->f_size / BLKSIZE) {
+            dir_block_ref(new_blockno);
+            flush_queue_move(oldbno, new_blockno);
+        }
+        if (shared) {
+            // The previous version is now the only one using blk
+            delta_encode(f->f_next_file, i);
+            compact_add(f, i);
+        } else
+            free_block(oldbno);
+    }
+    return 0;
+}
+
+// Replace the indirect block in the slot at *pblockno with a copy of
+// it if it is the block 'shared', which the previous version uses.
+static int
+indirect_copy(uint32_t *pblockno, uint32_t shared)
+{
+    if (*pblockno && *pblockno == shared) {
+        int new_blockno = alloc_block();
+        if (new_blockno < 0)
+            return new_blockno;
+        memcpy(diskaddr(new_blockno), diskaddr(*pblockno), BLKSIZE);
+        *pblockno = new_blockno;
+    }
+    return 0;
+}
+
+// Give f its own copies of the indirect blocks on the way to its
+// filebno'th block pointer that it still shares with the previous
+// version, so that changing the pointer does not change the previous
+// version too.
+static int
+copy_indirect(struct File *f, uint32_t filebno)
+{
+    struct File *next = f->f_next_file;
+    uint32_t k, b, *l1;
+    int r;
+
+    if (!next || filebno < NDIRECT || filebno >= MAXFILEBLKS)
+        return 0;
+    // As in file_block_walk, the packed members are copied out and back
+    if (filebno < NDIRECT + NINDIRECT) {
+        b = f->f_indirect;
+        r = indirect_copy(&b, next->f_indirect);
+        f->f_indirect = b;
+        return r;
+    }
+
+    // A copied double-indirect block still shares all its indirect
+    // blocks, so this copies the one below it too.
+    b = f->f_dindirect;
+    r = indirect_copy(&b, next->f_dindirect);
+    f->f_dindirect = b;
+    if (r < 0 || !b)
+        return r;
+    k = (filebno - NDIRECT - NINDIRECT) / NINDIRECT;
+    l1 = diskaddr(f->f_dindirect);
+    return indirect_copy(&l1[k], version_ind(next, filebno));
+}
+
+// Find the disk block number slot for the filebno'th block in file 'f',
+// ready to be modified: the block is allocated if necessary, and both
+// it and the indirect blocks leading to it are copied if they are still
+// shared with the previous version of f.
+//
+// Returns 0 on success, < 0 on error.
+static int
+file_get_write_diskbno(struct File *f, uint32_t filebno, uint32_t **ppdiskbno)
+{
+    int r;
+
+    if ((r = copy_indirect(f, filebno)) < 0)
+        return r;
+    if ((r = file_get_diskbno(f, filebno, ppdiskbno)) < 0)
+        return r;
+    return copy_block(f, filebno, *ppdiskbno);
+}
+
+// Like file_get_block, but the block may be modified; see
+// file_get_write_diskbno.
+static int
+file_get_write_block(struct File *f, uint32_t filebno, char **blk)
+{
+    uint32_t *diskbno;
+    int r = file_get_write_diskbno(f, filebno, &diskbno);
+    if (r < 0)
+        return r;
+    *blk = diskaddr(*diskbno);
+    return 0;
+}
+
+// --------------------------------------------------------------
+// Directories
+// --------------------------------------------------------------
+
+// A directory's data blocks are an array of 'struct File' slots, as
+// read by ls.  Once a directory outgrows one block it also gets an
+// open-addressing hash table from name to slot number, kept in the
+// f_dirhash blocks just below file block DIRHASHEND.  The table lives
+// in the directory's own block space so that it is copied on write
+// with the rest of the directory, and old versions of a directory keep
+// the table that matches their slots.
+//
+// A table entry is 0 if empty, DIRHASH_DELETED if its file was removed,
+// and otherwise the slot number plus one.  Removed entries only end a
+// probe once reused, so the table is rebuilt once they fill a quarter
+// of it; live entries fill at most half.
+#define DIRHASHEND	(NDIRECT + NINDIRECT)
+#define NDIRHASH	(BLKSIZE / 4)
+#define DIRHASH_DELETED	0xFFFFFFFF
+
+static uint32_t
+dir_hash(const char *name)
+{
+    uint32_t h = 2166136261;
+    while (*name)
+        h = (h ^ (uint8_t) *name++) * 16777619;
+    return h;
+}
+
+// Set *entry to the hash table entry for bucket b of dir.
+static int
+dir_hash_entry(struct File *dir, uint32_t b, bool write, uint32_t **entry)
+{
+    uint32_t filebno = DIRHASHEND - dir->f_dirhash + b / NDIRHASH;
+    char *blk;
+    int r;
+
+    if (write)
+        r = file_get_write_block(dir, filebno, &blk);
+    else
+        r = file_get_block(dir, filebno, &blk);
+    if (r < 0)
+        return r;
+    *entry = (uint32_t*) blk + b % NDIRHASH;
+    return 0;
+}
+
+// Set *file to slot 'slot' of dir.
+static int
+dir_slot(struct File *dir, uint32_t slot, bool write, struct File **file)
+{
+    char *blk;
+    int r;
+
+    if (write)
+        r = file_get_write_block(dir, slot / BLKFILES, &blk);
+    else
+        r = file_get_block(dir, slot / BLKFILES, &blk);
+    if (r < 0)
+        return r;
+    *file = (struct File*) blk + slot % BLKFILES;
+    return 0;
+}
+
+// Probe the hash table of dir for name.  On success set *entry to the
+// table entry holding it.  Otherwise, if insert is set, set *entry to
+// the first free entry on the probe path and return -E_NOT_FOUND.
+static int
+dir_hash_find(struct File *dir, const char *name, bool write,
+        uint32_t **entry, bool insert)
+{
+    uint32_t nbuckets = dir->f_dirhash * NDIRHASH;
+    uint32_t b = dir_hash(name), i;
+    uint32_t *e, *avail = NULL;
+    struct File *f;
+    int r;
+
+    for (i = 0; i < nbuckets; i++, b++) {
+        if ((r = dir_hash_entry(dir, b % nbuckets, write, &e)) < 0)
             return r;
-        if (*diskbno == *next_diskbno) {
-            int new_blockno = alloc_block();
-            if (new_blockno < 0)
-                return new_blockno;
-            void *blk = ROUNDDOWN(diskaddr(*diskbno), BLKSIZE);
-            memcpy(diskaddr(new_blockno), blk, BLKSIZE);
-            *diskbno = new_blockno;
+        if (*e == 0 || *e == DIRHASH_DELETED) {
+            if (!avail)
+                avail = e;
+            if (*e == 0)
+                break;
+            continue;
+        }
+        if ((r = dir_slot(dir, *e - 1, false, &f)) < 0)
+            return r;
+        if (strcmp(f->f_name, name) == 0) {
+            *entry = e;
+            return 0;
         }
     }
+    if (insert && avail)
+        *entry = avail;
+    return -E_NOT_FOUND;
+}
+
+// Return the number of hash table blocks a directory of nblock data
+// blocks should have: none for a single block, otherwise enough for
+// twice as many buckets as slots.
+static uint32_t
+dir_hash_size(uint32_t nblock)
+{
+    uint32_t nhash = 1;
+
+    if (nblock < 2)
+        return 0;
+    while (nhash * NDIRHASH < 2 * nblock * BLKFILES)
+        nhash *= 2;
+    return nhash;
+}
+
+// Rebuild the hash table of dir at the size its slots call for.
+static int
+dir_hash_rebuild(struct File *dir)
+{
+    uint32_t nblock = dir->f_size / BLKSIZE;
+    uint32_t nhash = dir_hash_size(nblock), i, slot, *e;
+    struct File *f;
+    char *blk;
+    int r;
+
+    dir->f_dirhash = nhash;
+    dir->f_dirdead = 0;
+    for (i = 0; i < nhash; i++) {
+        if ((r = file_get_write_block(dir, DIRHASHEND - nhash + i, &blk)) < 0)
+            return r;
+        memset(blk, 0, BLKSIZE);
+    }
+    for (slot = 0; slot < nblock * BLKFILES; slot++) {
+        if ((r = dir_slot(dir, slot, false, &f)) < 0)
+            return r;
+        if (f->f_name[0] == '\0')
+            continue;
+        if ((r = dir_hash_find(dir, f->f_name, true, &e, true)) != -E_NOT_FOUND)
+            return r < 0 ? r : -E_FILE_EXISTS;
+        *e = slot + 1;
+    }
     return 0;
 }
 
@@ -231,10 +1146,16 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, *e;
 	char *blk;
 	struct File *f;
 
+    if (dir->f_dirhash) {
+        if ((r = dir_hash_find(dir, name, false, &e, false)) < 0)
+            return r;
+        return dir_slot(dir, *e - 1, false, file);
+    }
+
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
@@ -253,17 +1174,21 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
+// Block that alloc_file hands out File structures from, or NULL
+static struct File *alloc_file_blk;
+
 static int
 alloc_file(struct File **file)
 {
-    static struct File *f = NULL;
+    struct File *f = alloc_file_blk;
     int i;
 
     if (f == NULL) {
         int blockno = alloc_block();
         if (blockno < 0)
             return blockno;
-        f = diskaddr(blockno);
+        f = alloc_file_blk = diskaddr(blockno);
+        memset(f, 0, BLKSIZE);
     }
 
     for (i = 0; i < BLKFILES - 1; i++)
@@ -272,42 +1197,62 @@ alloc_file(struct File **file)
             return 0;
         }
     *file = &f[i];
-    f = NULL;
+    alloc_file_blk = NULL;
     return 0;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, cleared and named
+// 'name'.  The caller is responsible for filling in the other File
+// fields.  The search for a free slot starts at dir->f_dirfree, below
+// which every slot is known to be in use.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t nblock, i, j;
+	uint32_t nblock, slot, *e;
 	char *blk;
 	struct File *f;
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
-        uint32_t *diskbno;
-        if ((r = file_get_diskbno(dir, i, &diskbno)) < 0)
+    for (slot = dir->f_dirfree; slot < nblock * BLKFILES; slot++) {
+        if ((r = dir_slot(dir, slot, false, &f)) < 0)
             return r;
-
-        f = (struct File*) diskaddr(*diskbno);
-        for (j = 0; j < BLKFILES; j++)
-            if (f[j].f_name[0] == '\0') {
-                copy_block(dir, i, diskbno);
-                *file = ((struct File*) diskaddr(*diskbno)) + j;
-                break;
-            }
+        if (f->f_name[0] == '\0')
+            break;
     }
-    if (i == nblock) {
+    if (slot == nblock * BLKFILES) {
+        if (nblock + 1 + dir_hash_size(nblock + 1) > DIRHASHEND)
+            return -E_NO_DISK;
         dir->f_size += BLKSIZE;
-        if ((r = file_get_block(dir, nblock, &blk)) < 0)
+        if ((r = file_get_write_block(dir, nblock, &blk)) < 0)
             return r;
-        *file = (struct File*) blk;
+        memset(blk, 0, BLKSIZE);
+        nblock++;
     }
+
+    if ((r = dir_slot(dir, slot, true, &f)) < 0)
+        return r;
+    memset(f, 0, sizeof(struct File));
+    strcpy(f->f_name, name);
+    dir->f_dirfree = slot + 1;
     dir->f_dirty = true;
+
+    // Index the new name, growing the table once it is half full.
+    if (dir->f_dirhash != dir_hash_size(nblock))
+        r = dir_hash_rebuild(dir);
+    else if (dir->f_dirhash) {
+        if ((r = dir_hash_find(dir, name, true, &e, true)) == -E_NOT_FOUND) {
+            if (*e == DIRHASH_DELETED)
+                dir->f_dirdead--;
+            *e = slot + 1;
+            r = 0;
+        }
+    }
+    if (r < 0)
+        return r;
+
+    *file = f;
     return 0;
 }
 
@@ -316,26 +1261,36 @@ static int
 dir_remove_file(struct File *dir, struct File *file)
 {
     int r;
-    uint32_t nblock, i, j;
+    uint32_t nblock, slot, *e;
     struct File *f;
 
     assert((dir->f_size % BLKSIZE) == 0);
     nblock = dir->f_size / BLKSIZE;
-    for (i = 0; i < nblock; i++) {
-        uint32_t *diskbno;
-        if ((r = file_get_diskbno(dir, i, &diskbno)) < 0)
+    if (dir->f_dirhash) {
+        if ((r = dir_hash_find(dir, file->f_name, true, &e, false)) < 0)
             return r;
-
-        f = (struct File*) diskaddr(*diskbno);
-        for (j = 0; j < BLKFILES; j++)
-            if (strcmp(f[j].f_name, file->f_name) == 0) {
-                copy_block(dir, i, diskbno);
-                ((struct File*) diskaddr(*diskbno))[j].f_name[0] = '\0';
-                dir->f_dirty = true;
-                return 0;
-            }
+        slot = *e - 1;
+        *e = DIRHASH_DELETED;
+        dir->f_dirdead++;
+    } else {
+        for (slot = 0; slot < nblock * BLKFILES; slot++) {
+            if ((r = dir_slot(dir, slot, false, &f)) < 0)
+                return r;
+            if (strcmp(f->f_name, file->f_name) == 0)
+                break;
+        }
+        if (slot == nblock * BLKFILES)
+            return -E_NOT_FOUND;
     }
-    return -E_NOT_FOUND;
+
+    if ((r = dir_slot(dir, slot, true, &f)) < 0)
+        return r;
+    f->f_name[0] = '\0';
+    dir->f_dirfree = MIN(dir->f_dirfree, slot);
+    dir->f_dirty = true;
+    if (dir->f_dirdead > dir->f_dirhash * NDIRHASH / 4)
+        return dir_hash_rebuild(dir);
+    return 0;
 }
 
 // Skip over slashes.
@@ -357,10 +1312,181 @@ get_timestamp_from_path(const char *p)
     return parse_time(p, sys_time_msec());
 }
 
+// While the garbage collector drops versions of a file, their entries
+// in its version index are left with a null ve_file; the index is
+// compacted once the file's history has been thinned (see fs_gc).
+static uint32_t gc_vindex;	// index that may hold dropped entries
+
+static bool
+gc_index_busy(uint32_t vindex)
+{
+    return vindex == gc_vindex;
+}
+
+// Return the i'th entry of version index vi.
+static struct VersionEntry *
+version_entry(struct VersionIndex *vi, uint32_t i)
+{
+    struct VersionEntry *ve = diskaddr(vi->vi_blocks[i / NVENTRIES]);
+    return &ve[i % NVENTRIES];
+}
+
+// Return the number of the last entry with timestamp <= 'timestamp',
+// or -1 if every entry is newer.
+static int
+version_search(struct VersionIndex *vi, time_t timestamp)
+{
+    int lo = 0, hi = vi->vi_nentries;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (version_entry(vi, mid)->ve_timestamp <= timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+// Return the number of the entry for version v in vi, or -1.
+static int
+version_position(struct VersionIndex *vi, struct File *v)
+{
+    int i = version_search(vi, v->f_timestamp);
+    for (; i >= 0; i--) {
+        struct VersionEntry *ve = version_entry(vi, i);
+        if (ve->ve_file == v)
+            return i;
+        if (ve->ve_timestamp != v->f_timestamp)
+            break;
+    }
+    return -1;
+}
+
+// Make sure entry blocks exist for the first n entries of vi.
+static int
+version_reserve(struct VersionIndex *vi, uint32_t n)
+{
+    uint32_t i;
+    for (i = 0; i * NVENTRIES < n; i++)
+        if (!vi->vi_blocks[i]) {
+            int blockno = alloc_block();
+            if (blockno < 0)
+                return blockno;
+            vi->vi_blocks[i] = blockno;
+        }
+    return 0;
+}
+
+// Append version v to the index of f.  Timestamps must not go
+// backwards for the binary search to work, so an out-of-order clock is
+// clamped to the last entry, and v takes the clamped time too so that
+// version_position finds it.  A full index just stops growing: lookups
+// newer than its last entry walk the chain instead.  So does one that
+// missed a version for want of disk space, since entries after the gap
+// would hide the missing version from lookups.
+static int
+version_append(struct File *f, struct File *v)
+{
+    struct VersionIndex *vi = diskaddr(f->f_vindex);
+    struct VersionEntry *ve;
+    uint32_t n = vi->vi_nentries;
+    time_t timestamp = v->f_timestamp;
+    int r;
+
+    if (n == MAXVERSIONS)
+        return 0;
+    if (n > 0 ? version_entry(vi, n - 1)->ve_file != v->f_next_file
+              : v->f_next_file != NULL)
+        return 0;
+    if ((r = version_reserve(vi, n + 1)) < 0)
+        return r;
+    if (n > 0 && version_entry(vi, n - 1)->ve_timestamp > timestamp) {
+        timestamp = version_entry(vi, n - 1)->ve_timestamp;
+        v->f_timestamp = timestamp;
+        flush_block(v);
+    }
+
+    ve = version_entry(vi, n);
+    ve->ve_timestamp = timestamp;
+    ve->ve_file = v;
+    vi->vi_nentries = n + 1;
+    flush_block(ve);
+    flush_block(vi);
+    return 0;
+}
+
+// Make sure f has a version index.  Files written before the index
+// existed get one built from their f_next_file chain.
+static int
+version_index_init(struct File *f)
+{
+    struct VersionIndex *vi;
+    struct VersionEntry *ve;
+    struct File *v;
+    time_t timestamp = ~0;
+    uint32_t i, n = 0;
+    int blockno, r;
+
+    if (f->f_vindex)
+        return 0;
+    if ((blockno = alloc_block()) < 0)
+        return blockno;
+    vi = diskaddr(blockno);
+    memset(vi, 0, BLKSIZE);
+
+    // Fill the entries newest first, walking the chain once.  If the
+    // chain is too long, index its oldest MAXVERSIONS versions.
+    for (v = f->f_next_file; v; v = v->f_next_file)
+        n++;
+    for (v = f->f_next_file; n > MAXVERSIONS; n--)
+        v = v->f_next_file;
+    if ((r = version_reserve(vi, n)) < 0) {
+        for (i = 0; i < NVBLOCKS && vi->vi_blocks[i]; i++)
+            free_block(vi->vi_blocks[i]);
+        free_block(blockno);
+        return r;
+    }
+    vi->vi_nentries = n;
+    for (; n > 0; v = v->f_next_file) {
+        ve = version_entry(vi, --n);
+        timestamp = MIN(timestamp, v->f_timestamp);
+        // As in version_append, the version takes the clamped time
+        v->f_timestamp = timestamp;
+        ve->ve_timestamp = timestamp;
+        ve->ve_file = v;
+        v->f_vindex = blockno;
+        flush_block(v);
+        if (n % NVENTRIES == 0)
+            flush_block(ve);
+    }
+    flush_block(vi);
+    f->f_vindex = blockno;
+    return 0;
+}
+
 // Find correct time version of a file.
+//
+// *f is the newest version to consider.  Older versions come from the
+// version index when f has one; the f_next_file chain is only walked
+// for files without an index, or for versions newer than a full index.
 static int
 find_time_version(const time_t timestamp, struct File **f)
 {
+    struct VersionIndex *vi;
+    int i;
+
+    if ((*f) && (*f)->f_timestamp > timestamp && (*f)->f_vindex) {
+        vi = diskaddr((*f)->f_vindex);
+        if (vi->vi_nentries > 0 &&
+                version_entry(vi, vi->vi_nentries - 1)->ve_timestamp
+                > timestamp) {
+            i = version_search(vi, timestamp);
+            while (i >= 0 && !version_entry(vi, i)->ve_file)
+                i--;
+            *f = i < 0 ? NULL : version_entry(vi, i)->ve_file;
+        }
+    }
+
     while ((*f) && (*f)->f_timestamp > timestamp)
         *f = (*f)->f_next_file;
     if (*f)
@@ -369,6 +1495,97 @@ find_time_version(const time_t timestamp, struct File **f)
         return -E_NOT_FOUND;
 }
 
+// --------------------------------------------------------------
+// Name cache
+// --------------------------------------------------------------
+
+// walk_path resolves every component of every path from the root, so
+// the results of dir_lookup are cached, keyed by the directory's
+// struct File and the name.  Each struct File is one version of a
+// directory, so the key already pins the version being looked up in.
+// Entries are dropped when their directory is changed by a create,
+// remove or flush, since that can move its entries to new blocks.
+//
+// An entry in a past version of a directory also keeps the current
+// version of its file (see walk_path), as found in dc_headdir, and is
+// dropped when that directory changes too.
+#define NDCACHE		512
+
+struct Dcache {
+    struct File *dc_dir;
+    struct File *dc_file;
+    struct File *dc_headdir;	// current version of dc_dir, or NULL
+    struct File *dc_head;	// dc_file's current version in it, or NULL
+    char dc_name[MAXNAMELEN];
+};
+
+static struct Dcache dcache[NDCACHE];
+
+static struct Dcache *
+dcache_slot(struct File *dir, const char *name)
+{
+    uint32_t h = (uint32_t) dir;
+    while (*name)
+        h = (h ^ (uint8_t) *name++) * 16777619;
+    return &dcache[h % NDCACHE];
+}
+
+// Look name up in dir, consulting the name cache first.
+static int
+dcache_lookup(struct File *dir, const char *name, struct File **file)
+{
+    struct Dcache *dc = dcache_slot(dir, name);
+    int r;
+
+    if (dc->dc_dir == dir && strcmp(dc->dc_name, name) == 0) {
+        fs_stats.st_dcache_hits++;
+        *file = dc->dc_file;
+        return 0;
+    }
+
+    fs_stats.st_dcache_misses++;
+    if ((r = dir_lookup(dir, name, file)) < 0)
+        return r;
+    dc->dc_dir = dir;
+    dc->dc_file = *file;
+    dc->dc_headdir = NULL;
+    strcpy(dc->dc_name, name);
+    return 0;
+}
+
+// Return the current version of file f, found as name in dir, a past
+// version of directory head, or NULL if head no longer has it.
+static struct File *
+dcache_head(struct File *dir, struct File *head, const char *name,
+        struct File *f)
+{
+    struct Dcache *dc = dcache_slot(dir, name);
+    struct File *h;
+
+    if (dc->dc_dir == dir && dc->dc_headdir == head &&
+            strcmp(dc->dc_name, name) == 0)
+        return dc->dc_head;
+
+    if (head->f_type != FTYPE_DIR || dir_lookup(head, name, &h) < 0 ||
+            (h != f && (!h->f_vindex || h->f_vindex != f->f_vindex)))
+        h = NULL;
+    if (dc->dc_dir == dir && strcmp(dc->dc_name, name) == 0) {
+        dc->dc_headdir = head;
+        dc->dc_head = h;
+    }
+    return h;
+}
+
+// Drop the cached entries of dir, or everything if dir is NULL.
+static void
+dcache_invalidate(struct File *dir)
+{
+    int i;
+    for (i = 0; i < NDCACHE; i++)
+        if (!dir || dcache[i].dc_dir == dir || dcache[i].dc_headdir == dir)
+            dcache[i].dc_dir = NULL;
+}
+
 // Evaluate a path name, starting at the root.
 // On success, set *pf to the file we found
 // and set *pdir to the directory the file is in.
@@ -380,7 +1597,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 {
 	const char *p;
 	char name[MAXNAMELEN];
-	struct File *dir, *f;
+	struct File *dir, *f, *head, *h;
 	int r;
     time_t timestamp;
 
@@ -390,7 +1607,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
     timestamp = get_timestamp_from_path(path);
 
     // Find the correct time version of root
-	f = &super->s_root;
+	f = head = &super->s_root;
     if ((r = find_time_version(timestamp, &f)) < 0)
         return r;
 
@@ -411,27 +1628,319 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		name[path - p] = '\0';
 		path = skip_slash(path);
 
-		if (dir->f_type != FTYPE_DIR)
-			return -E_NOT_FOUND;
+		if (dir->f_type != FTYPE_DIR)
+			return -E_NOT_FOUND;
+
+		if ((r = dcache_lookup(dir, name, &f)) < 0) {
+			if (r == -E_NOT_FOUND && (*path == '\0' || *path == '@')) {
+				if (pdir)
+					*pdir = dir;
+				if (lastelem)
+					strcpy(lastelem, name);
+				*pf = 0;
+			}
+			return r;
+		}
+
+        // Past versions of dir hold copies of the File structures of
+        // its files, which are not kept up to date as the blocks of old
+        // versions are reworked or the garbage collector drops them, so
+        // a file that still exists is followed from its current version
+        // instead.  head is the current version of dir, or NULL if it
+        // no longer exists.
+        h = NULL;
+        if (head == dir)
+            h = f;
+        else if (head && (h = dcache_head(dir, head, name, f)))
+            f = h;
+        else {
+            // A copy's own blocks may since have been freed (see
+            // file_remove): only its history counts.
+            if (!(f = f->f_next_file))
+                return -E_NOT_FOUND;
+        }
+        head = h;
+
+        if ((r = find_time_version(timestamp, &f)) < 0)
+            return r;
+	}
+
+	if (pdir)
+		*pdir = dir;
+	*pf = f;
+	return 0;
+}
+
+// --------------------------------------------------------------
+// Reclaiming space
+// --------------------------------------------------------------
+
+// A version shares a block with the versions next to it by pointing at
+// the same block, and blocks shared any other way are counted in the
+// reference count table (see dedup_block and dir_block_ref).  So a
+// version's block can be freed once the versions on either side of it
+// use others, and free_block takes care of the rest.
+
+static void history_release(struct File *f);
+
+// Return the i'th block pointer of version v, or 0 if none.
+static uint32_t
+version_bno(struct File *v, uint32_t i)
+{
+    uint32_t *p;
+
+    if (!v || file_block_walk(v, i, &p, 0) < 0)
+        return 0;
+    return *p;
+}
+
+// Return the first block number from i on at which version v may have
+// a pointer that neither u nor w has, skipping over the indirect blocks
+// v lacks or shares with either, or MAXFILEBLKS if there is none.
+static uint32_t
+version_scan(struct File *v, struct File *u, struct File *w, uint32_t i)
+{
+    uint32_t b;
+
+    while (i < MAXFILEBLKS) {
+        if (i < NDIRECT)
+            return i;
+        if (i >= NDIRECT + NINDIRECT && (!v->f_dindirect ||
+                (u && v->f_dindirect == u->f_dindirect) ||
+                (w && v->f_dindirect == w->f_dindirect)))
+            break;
+        b = version_ind(v, i);
+        if (b && b != version_ind(u, i) && b != version_ind(w, i))
+            return i;
+        // On to the first pointer of the next indirect block
+        i = ROUNDUP(i + 1 - NDIRECT, NINDIRECT) + NDIRECT;
+    }
+    return MAXFILEBLKS;
+}
+
+// Release the File structures in directory block blockno, which is
+// about to be freed.
+static void
+dir_block_release(uint32_t blockno)
+{
+    struct File *f = diskaddr(blockno);
+    int i;
+
+    for (i = 0; i < BLKFILES; i++)
+        if (f[i].f_name[0])
+            history_release(&f[i]);
+}
+
+// Free the blocks and records of version v that neither u, the version
+// before it, nor w, the version after it, uses; either may be NULL.
+// Returns the number freed.
+static int
+version_free_blocks(struct File *u, struct File *v, struct File *w)
+{
+    uint32_t i, b;
+    int nfreed = 0;
+
+    for (i = version_scan(v, u, w, 0); i < MAXFILEBLKS;
+         i = version_scan(v, u, w, i + 1)) {
+        b = version_bno(v, i);
+        if (!b || b == version_bno(u, i) || b == version_bno(w, i))
+            continue;
+        if (BLKPTR_ISDELTA(b))
+            delta_release(b);
+        else {
+            if (v->f_type == FTYPE_DIR && i < v->f_size / BLKSIZE)
+                dir_block_release(b);
+            free_block(b);
+        }
+        nfreed++;
+    }
+
+    if (v->f_indirect && (!u || v->f_indirect != u->f_indirect) &&
+            (!w || v->f_indirect != w->f_indirect)) {
+        free_block(v->f_indirect);
+        nfreed++;
+    }
+    if (v->f_dindirect && (!u || v->f_dindirect != u->f_dindirect) &&
+            (!w || v->f_dindirect != w->f_dindirect)) {
+        for (i = NDIRECT + NINDIRECT; i < MAXFILEBLKS; i += NINDIRECT) {
+            b = version_ind(v, i);
+            if (b && b != version_ind(u, i) && b != version_ind(w, i)) {
+                free_block(b);
+                nfreed++;
+            }
+        }
+        free_block(v->f_dindirect);
+        nfreed++;
+    }
+    return nfreed;
+}
+
+// Would freeing the blocks of directory version v that neither u nor w
+// uses free a File structure some client has open?  An open file points
+// straight at its File structure, which stays in the old block when
+// the directory is copied on write.
+static bool
+version_holds_open(struct File *u, struct File *v, struct File *w)
+{
+    struct File *e;
+    uint32_t i, b;
+    int j;
+
+    if (v->f_type != FTYPE_DIR)
+        return false;
+    for (i = 0; i < v->f_size / BLKSIZE; i++) {
+        b = version_bno(v, i);
+        if (!b || b == version_bno(u, i) || b == version_bno(w, i))
+            continue;
+        e = diskaddr(b);
+        for (j = 0; j < BLKFILES; j++)
+            if (e[j].f_name[0] && file_is_open(&e[j]))
+                return true;
+    }
+    return false;
+}
+
+// Forget version v, which is no longer in any history, and free its
+// block of File structures once that is empty.
+static void
+version_forget(struct File *v)
+{
+    struct File *blk;
+    int i;
+
+    for (i = 0; i < NCOMPACT; i++)
+        if (compact_queue[i].c_version == v)
+            compact_queue[i].c_version = NULL;
+    if (v->f_type == FTYPE_DIR)
+        dcache_invalidate(v);
+    memset(v, 0, sizeof(struct File));
+    blk = ROUNDDOWN(v, BLKSIZE);
+    for (i = 0; i < BLKFILES && !blk[i].f_name[0]; i++)
+        ;
+    if (i == BLKFILES && blk != alloc_file_blk)
+        free_block(((uintptr_t) blk - DISKMAP) / BLKSIZE);
+}
+
+// Free the whole history f leads to, and its version index.
+static void
+history_free(struct File *f)
+{
+    struct VersionIndex *vi = diskaddr(f->f_vindex);
+    struct File *v, *w;
+    uint32_t i;
+
+    // Walking from the newest, each run of versions sharing a block
+    // frees it at its oldest version.
+    for (v = f->f_next_file; v; v = w) {
+        w = v->f_next_file;
+        version_free_blocks(NULL, v, w);
+        version_forget(v);
+    }
+    for (i = 0; i < NVBLOCKS && vi->vi_blocks[i]; i++)
+        free_block(vi->vi_blocks[i]);
+    if (gc_vindex == f->f_vindex)
+        gc_vindex = 0;
+    free_block(f->f_vindex);
+    f->f_next_file = NULL;
+    f->f_vindex = 0;
+}
+
+// Is f one of the old versions in its version index, rather than a
+// head or a directory's copy of one?  Old versions share their blocks
+// and index with the head, so they must never be truncated or removed.
+static bool
+file_is_version(struct File *f)
+{
+    return f->f_vindex &&
+        version_position(diskaddr(f->f_vindex), f) >= 0;
+}
+
+// Drop File structure f's reference to its history, freeing the history
+// if that was the last one.  Without a reference count table histories
+// are never freed.
+static void
+history_release(struct File *f)
+{
+    uint16_t *ref;
+
+    assert(!file_is_version(f));
+    if (!f->f_vindex || !(ref = block_refent(f->f_vindex)))
+        return;
+    if (*ref & REF_COUNT) {
+        if ((*ref & REF_COUNT) != REF_COUNT)
+            (*ref)--;
+        return;
+    }
+    history_free(f);
+}
+
+// Clear the pointers from the keep'th on in the indirect block in the
+// slot at *pblockno, or if keep is 0, clear the slot and free the block
+// unless it is 'shared', the previous version's.  A block that keeps
+// some pointers must not be shared.
+static void
+indirect_truncate(uint32_t *pblockno, uint32_t shared, uint32_t keep)
+{
+    uint32_t *ind;
+
+    if (!*pblockno)
+        return;
+    if (!keep) {
+        if (*pblockno != shared)
+            free_block(*pblockno);
+        *pblockno = 0;
+    } else if (keep < NINDIRECT) {
+        ind = diskaddr(*pblockno);
+        memset(&ind[keep], 0, (NINDIRECT - keep) * sizeof(*ind));
+    }
+}
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
-			if (r == -E_NOT_FOUND && (*path == '\0' || *path == '@')) {
-				if (pdir)
-					*pdir = dir;
-				if (lastelem)
-					strcpy(lastelem, name);
-				*pf = 0;
-			}
-			return r;
-		}
-        if ((r = find_time_version(timestamp, &f)) < 0)
-            return r;
-	}
+// Free the blocks the head f uses from file block nblocks on that its
+// previous version does not use, and clear its pointers to them.
+static int
+file_free_tail(struct File *f, uint32_t nblocks)
+{
+    struct File *next = f->f_next_file;
+    uint32_t i, b, n, *l1;
+    int r;
 
-	if (pdir)
-		*pdir = dir;
-	*pf = f;
-	return 0;
+    assert(!file_is_version(f));
+    // Pointers in indirect blocks shared with the previous version must
+    // not change, so first copy those that keep some.
+    if (nblocks > NDIRECT && (r = copy_indirect(f, nblocks - 1)) < 0)
+        return r;
+    for (i = version_scan(f, next, NULL, nblocks); i < MAXFILEBLKS;
+         i = version_scan(f, next, NULL, i + 1)) {
+        b = version_bno(f, i);
+        if (b && b != version_bno(next, i))
+            free_block(b);
+    }
+
+    // The packed members are copied out and back, as in file_block_walk
+    for (i = nblocks; i < NDIRECT; i++)
+        f->f_direct[i] = 0;
+    b = f->f_indirect;
+    indirect_truncate(&b, next ? next->f_indirect : 0,
+                      nblocks > NDIRECT ? nblocks - NDIRECT : 0);
+    f->f_indirect = b;
+    if (!f->f_dindirect)
+        return 0;
+
+    // n pointers stay under the double-indirect block
+    n = nblocks > NDIRECT + NINDIRECT ? nblocks - NDIRECT - NINDIRECT : 0;
+    for (i = NDIRECT + NINDIRECT + ROUNDUP(n, NINDIRECT); i < MAXFILEBLKS;
+         i += NINDIRECT)
+        if ((b = version_ind(f, i)) && b != version_ind(next, i))
+            free_block(b);
+    if (n % NINDIRECT) {
+        l1 = diskaddr(f->f_dindirect);
+        indirect_truncate(&l1[n / NINDIRECT], 0, n % NINDIRECT);
+    }
+    b = f->f_dindirect;
+    indirect_truncate(&b, next ? next->f_dindirect : 0,
+                      ROUNDUP(n, NINDIRECT) / NINDIRECT);
+    f->f_dindirect = b;
+    return 0;
 }
 
 // --------------------------------------------------------------
@@ -452,15 +1961,15 @@ file_create(const char *path, bool isdir, struct File **pf)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	dcache_invalidate(dir);
+	bc_owner = dir;
+	if ((r = dir_alloc_file(dir, name, &f)) < 0)
 		return r;
 
-	strcpy(f->f_name, name);
-    file_set_size(f, 0);
     f->f_type = isdir ? FTYPE_DIR : FTYPE_REG;
-    f->f_next_file = NULL;
     f->f_timestamp = timestamp;
     f->f_dirty = true;
+    flush_block(f);
 
 	*pf = f;
 	file_flush(dir, timestamp);
@@ -483,15 +1992,23 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 {
 	int r, bn;
 	off_t pos;
+	uint32_t bno, last, *pdiskbno;
 	char *blk;
 
 	if (offset >= f->f_size)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
+	last = (offset + count - 1) / BLKSIZE;
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		// Read a block that is not cached together with the rest of
+		// its run on disk, rather than faulting them in one at a time
+		bno = pos / BLKSIZE;
+		if (file_block_walk(f, bno, &pdiskbno, 0) == 0 && *pdiskbno &&
+		    !BLKPTR_ISDELTA(*pdiskbno) && !va_is_mapped(diskaddr(*pdiskbno)))
+			bc_read_run(*pdiskbno, file_block_run(f, bno, last + 1 - bno));
+		if ((r = file_get_block(f, bno, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(buf, blk + pos % BLKSIZE, bn);
@@ -502,6 +2019,183 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Check whether file_read(f, buf, count, offset) can run without
+// waiting for the disk.  If a block it needs is not cached, start
+// reading it in the background, together with the blocks after it that
+// are contiguous on disk.  The nra blocks after the read are read ahead
+// the same way.  Returns 1 if every block the read needs is cached,
+// or 0 if the read should be retried once the disk is done.
+int
+file_read_ready(struct File *f, size_t count, off_t offset, int nra)
+{
+	int r;
+	uint32_t bno, last, end, n, *pdiskbno;
+
+	if (offset >= f->f_size || count == 0)
+		return 1;
+	count = MIN(count, f->f_size - offset);
+	last = (offset + count - 1) / BLKSIZE;
+	end = MIN(last + 1 + nra, (f->f_size + BLKSIZE - 1) / BLKSIZE);
+
+	for (bno = offset / BLKSIZE; bno < end; bno++) {
+		// Leave errors, holes and deltas to file_read
+		if (file_block_walk(f, bno, &pdiskbno, 0) < 0 || *pdiskbno == 0 ||
+		    BLKPTR_ISDELTA(*pdiskbno))
+			continue;
+		if (va_is_mapped(diskaddr(*pdiskbno))) {
+			if (bno <= last)
+				bc_ra_use(*pdiskbno);
+			continue;
+		}
+
+		n = file_block_run(f, bno, MIN(end - bno, BC_MAXRUN));
+		r = bc_read_async(*pdiskbno, n, bno <= last ? last + 1 - bno : 0);
+		if (r == 0)
+			return bno > last;
+	}
+	return 1;
+}
+
+// Set *blk to the cached page of the filebno'th block of regular file f
+// so that it can be shared read-only with a client.  Only a block that
+// can no longer change is shared: one of an old version, or one of the
+// head that is copied before it is written because the previous
+// version or another file uses it too.  free_block takes the block
+// cache's page away from a shared block, so its next use gets a fresh
+// one and the client's copy stays as it was.
+// Returns 0 on success, or -E_INVAL if the block is a hole, a delta, or
+// may still be written in place.
+int
+file_map_block(struct File *f, uint32_t filebno, char **blk)
+{
+    uint32_t *p;
+
+    if (f->f_type != FTYPE_REG || file_block_walk(f, filebno, &p, 0) < 0 ||
+            !*p || BLKPTR_ISDELTA(*p))
+        return -E_INVAL;
+    // Old versions are never dirty, nor is a head with nothing unflushed
+    if (f->f_dirty && *p != version_bno(f->f_next_file, filebno) &&
+            !block_refs(*p))
+        return -E_INVAL;
+    *blk = diskaddr(*p);
+    // Bring it in before it is sent
+    (void) *(volatile char *) *blk;
+    return 0;
+}
+
+// Blocks written since a file was last flushed are looked up in the
+// fingerprint table when it is flushed, and replaced by an existing
+// block with the same contents if there is one.  This happens at flush
+// time rather than as blocks are written, because clients write in
+// pieces smaller than a block.  wranges remembers which file blocks
+// each file wrote; a file whose entry is taken over by another simply
+// misses out on deduplication for that version.
+#define NWRANGE		64
+
+static struct WriteRange {
+    struct File *wr_file;
+    uint32_t wr_lo, wr_hi;	// file blocks written, inclusive
+} wranges[NWRANGE];
+
+static struct WriteRange *
+write_range(struct File *f)
+{
+    return &wranges[(uintptr_t) f / sizeof(struct File) % NWRANGE];
+}
+
+static void
+write_range_add(struct File *f, uint32_t lo, uint32_t hi)
+{
+    struct WriteRange *wr = write_range(f);
+
+    if (wr->wr_file != f) {
+        wr->wr_file = f;
+        wr->wr_lo = lo;
+        wr->wr_hi = hi;
+        return;
+    }
+    wr->wr_lo = MIN(wr->wr_lo, lo);
+    wr->wr_hi = MAX(wr->wr_hi, hi);
+}
+
+// Share the filebno'th block of f with an existing block of the same
+// contents, or else add it to the fingerprint table.  Only blocks f
+// does not share with its previous version are considered.
+static void
+dedup_block(struct File *f, uint32_t filebno)
+{
+    struct FpEntry *fe, *empty = NULL;
+    uint32_t *p, *pnext = NULL, fp, oldbno;
+    char *blk;
+    int i;
+
+    if (file_block_walk(f, filebno, &p, 0) < 0 || !*p ||
+            BLKPTR_ISDELTA(*p))
+        return;
+    if (f->f_next_file &&
+            file_block_walk(f->f_next_file, filebno, &pnext, 0) < 0)
+        pnext = NULL;
+    if (pnext && *pnext == *p)
+        return;
+
+    blk = diskaddr(*p);
+    fp = block_fingerprint(blk);
+    for (i = 0; i < FP_WINDOW; i++) {
+        fe = fp_slot(fp + i);
+        // fp_forget finds entries by the block's contents when it is
+        // freed, so it misses blocks changed since they were entered.
+        // free_block clears REF_FP all the same, which marks them stale.
+        if (fe->fe_blockno && !(*block_refent(fe->fe_blockno) & REF_FP))
+            fe->fe_blockno = 0;
+        if (!fe->fe_blockno) {
+            if (!empty)
+                empty = fe;
+            continue;
+        }
+        if (fe->fe_blockno == *p)
+            return;
+        if (fe->fe_fp != fp || block_is_free(fe->fe_blockno) ||
+                memcmp(diskaddr(fe->fe_blockno), blk, BLKSIZE) != 0)
+            continue;
+
+        // Sharing the previous version's block needs no reference:
+        // versions share blocks by pointing at the same one.
+        if ((!pnext || *pnext != fe->fe_blockno) &&
+                block_ref(fe->fe_blockno) < 0)
+            return;
+        oldbno = *p;
+        *p = fe->fe_blockno;
+        free_block(oldbno);
+        fs_stats.st_dedup_hits++;
+        return;
+    }
+
+    if (empty) {
+        empty->fe_fp = fp;
+        empty->fe_blockno = *p;
+        *block_refent(*p) |= REF_FP;
+        fs_stats.st_dedup_fps++;
+    }
+}
+
+// Deduplicate the blocks f wrote since it was last flushed.
+static void
+dedup_file(struct File *f)
+{
+    struct WriteRange *wr = write_range(f);
+    uint32_t bno;
+
+    if (wr->wr_file != f)
+        return;
+    wr->wr_file = NULL;
+    if (!super->s_nfpmap || !super->s_nrefmap || f->f_type != FTYPE_REG)
+        return;
+    for (bno = wr->wr_lo; bno <= wr->wr_hi; bno++) {
+        if (bno * BLKSIZE >= f->f_size)
+            break;
+        dedup_block(f, bno);
+    }
+}
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -514,6 +2208,11 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	bc_owner = f;
+    if (offset < 0 || offset > MAXFILESIZE || count > MAXFILESIZE - offset)
+        return -E_INVAL;
+    flush_queue_settle(f);
+
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
@@ -521,9 +2220,8 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 
 	for (pos = offset; pos < offset + count; ) {
         uint32_t *diskbno;
-        if ((r = file_get_diskbno(f, pos / BLKSIZE, &diskbno)) < 0)
+        if ((r = file_get_write_diskbno(f, pos / BLKSIZE, &diskbno)) < 0)
             return r;
-        copy_block(f, pos / BLKSIZE, diskbno);
 
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
         memmove(diskaddr(*diskbno) + pos % BLKSIZE, buf, bn);
@@ -531,6 +2229,8 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 		buf += bn;
 	}
 
+    if (count)
+        write_range_add(f, offset / BLKSIZE, (offset + count - 1) / BLKSIZE);
     f->f_dirty = true;
 	return count;
 }
@@ -539,8 +2239,31 @@ int
 file_history(struct File *f, time_t *buf, size_t count, off_t offset)
 {
     time_t *buf_ptr = buf;
-    if (!f->f_dirty)
-        f = f->f_next_file;
+    struct VersionIndex *vi;
+    int i;
+
+    if (f->f_dirty) {
+        if (offset)
+            offset--;
+        else if (count--)
+            *buf_ptr++ = f->f_timestamp;
+        else
+            return buf_ptr - buf;
+    }
+    f = f->f_next_file;
+
+    // Older versions are consecutive entries of the version index,
+    // so skip 'offset' of them directly, unless the garbage collector
+    // is part way through dropping some of them.
+    if (f && f->f_vindex && !gc_index_busy(f->f_vindex)) {
+        vi = diskaddr(f->f_vindex);
+        if ((i = version_position(vi, f)) >= 0) {
+            for (i -= offset; i >= 0 && count--; i--)
+                *buf_ptr++ = version_entry(vi, i)->ve_file->f_timestamp;
+            return buf_ptr - buf;
+        }
+    }
+
     while (f) {
         if (offset)
             offset--;
@@ -554,66 +2277,277 @@ file_history(struct File *f, time_t *buf, size_t count, off_t offset)
     return buf_ptr - buf;
 }
 
-// Remove a block from file f.  If it's not there, just silently succeed.
-// Returns 0 on success, < 0 on error.
-static int
-file_free_block(struct File *f, uint32_t filebno)
-{
-	int r;
-	uint32_t *ptr;
-
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
-		return r;
-	if (*ptr) {
-		free_block(*ptr);
-		*ptr = 0;
-	}
-	return 0;
-}
-
 // Set the size of file f, truncating or extending as necessary.
+// Truncating frees the blocks past the new end that only the head
+// uses.
 int
 file_set_size(struct File *f, off_t newsize)
 {
+    char *blk;
+    int r;
+
+	bc_owner = f;
+    if (newsize < 0 || newsize > MAXFILESIZE)
+        return -E_INVAL;
+    flush_queue_settle(f);
+    if (f->f_type == FTYPE_REG && newsize < f->f_size) {
+        if ((r = file_free_tail(f, ROUNDUP(newsize, BLKSIZE) / BLKSIZE)) < 0)
+            return r;
+        // Extending the file again must read zeroes
+        if (newsize % BLKSIZE && version_bno(f, newsize / BLKSIZE)) {
+            if ((r = file_get_write_block(f, newsize / BLKSIZE, &blk)) < 0)
+                return r;
+            memset(blk + newsize % BLKSIZE, 0, BLKSIZE - newsize % BLKSIZE);
+        }
+        f->f_dirty = true;
+    }
 	f->f_size = newsize;
 	flush_block(f);
 	return 0;
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// The block cache tags each block written with the file it was written
+// for, so only the blocks that changed are visited.
 void
 file_flush(struct File *f, time_t timestamp)
 {
-	int i;
-	uint32_t *pdiskbno;
+    bc_owner = f;
+    if (f->f_type == FTYPE_DIR)
+        dcache_invalidate(f);
+    flush_queue_settle(f);
 
     if (f->f_dirty) {
         f->f_dirty = false;
         f->f_timestamp = timestamp;
+        dedup_file(f);
 
         // Copy file struct: F -> F2 -> ... to F -> F' -> F2 -> ...
         struct File *next_file;
         int r = alloc_file(&next_file);
         if (r < 0)
             panic("out of memory in file_flush");
+        // Without the disk space for it, the index just stops growing
+        if ((r = version_index_init(f)) < 0 && r != -E_NO_DISK)
+            panic("version index in file_flush: %e", r);
 
         memcpy(next_file, f, sizeof(struct File));
         f->f_next_file = next_file;
         flush_block(next_file);
+        if (f->f_vindex && (r = version_append(f, next_file)) < 0 &&
+            r != -E_NO_DISK)
+            panic("version index in file_flush: %e", r);
     }
 
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
-	}
+    bc_flush_owner(f);
 	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+}
+
+// Files closed without O_SYNC are flushed in batches.  file_flush_later
+// queues a file with the time it was closed, which becomes the new
+// version's timestamp, and fs_flush_pending flushes the queue once its
+// first entry has waited FLUSH_DELAY ms or when it is full, and commits
+// the lot at once.  An idle server waits for its next request only
+// until then (see fs_flush_delay).  A queued
+// file that is about to change or be flushed again is flushed first,
+// so each version holds just what the file held when it was closed.
+// Queued File structures live in directory blocks, so a directory block
+// copied on write takes its queued entries with it, and a removed file
+// leaves the queue.
+#define NFLUSH		64
+#define FLUSH_DELAY	100
+
+static struct FlushLater {
+    struct File *fl_file;
+    time_t fl_timestamp;	// when it was closed
+} flush_queue[NFLUSH];
+static uint32_t flush_nqueued;
+static time_t flush_since;	// when the first entry was queued
+
+// Point the entries for File structures in directory block oldbno at
+// their copies in block newbno.
+static void
+flush_queue_move(uint32_t oldbno, uint32_t newbno)
+{
+    uint32_t i;
+    char *old = diskaddr(oldbno);
+
+    for (i = 0; i < flush_nqueued; i++)
+        if ((char *) flush_queue[i].fl_file >= old &&
+                (char *) flush_queue[i].fl_file < old + BLKSIZE)
+            flush_queue[i].fl_file = (struct File *) ((char *) diskaddr(newbno) +
+                    ((char *) flush_queue[i].fl_file - old));
+}
+
+// Take f off the queue.
+static void
+flush_queue_drop(struct File *f)
+{
+    uint32_t i;
+
+    for (i = 0; i < flush_nqueued; i++)
+        if (flush_queue[i].fl_file == f) {
+            flush_queue[i] = flush_queue[--flush_nqueued];
+            return;
+        }
+}
+
+// If f is queued, flush it now, as of when it was closed.
+static void
+flush_queue_settle(struct File *f)
+{
+    uint32_t i;
+    time_t timestamp;
+
+    for (i = 0; i < flush_nqueued; i++)
+        if (flush_queue[i].fl_file == f) {
+            timestamp = flush_queue[i].fl_timestamp;
+            flush_queue[i] = flush_queue[--flush_nqueued];
+            file_flush(f, timestamp);
+            return;
+        }
+}
+
+// Queue f to be flushed by fs_flush_pending as of timestamp.  If it is
+// queued already it has not changed since, and keeps the earlier time.
+void
+file_flush_later(struct File *f, time_t timestamp)
+{
+    uint32_t i;
+
+    for (i = 0; i < flush_nqueued; i++)
+        if (flush_queue[i].fl_file == f)
+            return;
+    if (flush_nqueued == NFLUSH)
+        fs_flush_pending(true);
+    if (!flush_nqueued)
+        flush_since = sys_time_msec();
+    flush_queue[flush_nqueued].fl_file = f;
+    flush_queue[flush_nqueued].fl_timestamp = timestamp;
+    flush_nqueued++;
+}
+
+// Return how many ms are left before fs_flush_pending flushes the
+// queue, or -1 if it is empty.
+int
+fs_flush_delay(void)
+{
+    time_t waited;
+
+    if (!flush_nqueued)
+        return -1;
+    waited = sys_time_msec() - flush_since;
+    return waited >= FLUSH_DELAY ? 0 : FLUSH_DELAY - waited;
+}
+
+// Flush the queued files if the first has waited long enough or force
+// is set, and commit them.
+void
+fs_flush_pending(bool force)
+{
+    uint32_t i;
+
+    if (!flush_nqueued ||
+            (!force && sys_time_msec() - flush_since < FLUSH_DELAY))
+        return;
+    // Flushing moves no directory blocks, so the entries stay put.  Each
+    // leaves the queue before it is flushed.
+    while (flush_nqueued) {
+        i = --flush_nqueued;
+        file_flush(flush_queue[i].fl_file, flush_queue[i].fl_timestamp);
+    }
+    journal_commit();
+}
+
+// A file removed while open is moved out of its directory into a File
+// structure of its own, which its open files are pointed at, and is
+// released once the last of them is closed (see fs_gc).  The list is
+// only kept in memory, so a crash leaves such files allocated.  Every
+// file on it was open when added, and those that no longer are get
+// released before it is found full, so MAXOPEN entries are enough.
+#define NREMOVED	1024
+
+static struct File *removed[NREMOVED];
+static uint32_t nremoved;
+
+static int file_release(struct File *f, const char *name);
+
+// Release the removed files that are no longer open.
+static void
+removed_release(void)
+{
+    struct File *f;
+    uint32_t i;
+
+    for (i = 0; i < nremoved; ) {
+        f = removed[i];
+        if (file_is_open(f)) {
+            i++;
+            continue;
+        }
+        removed[i] = removed[--nremoved];
+        flush_queue_drop(f);
+        compact_forget(f);
+        file_release(f, f->f_name);
+        version_forget(f);
+    }
+}
+
+// Move the open file f, named name, onto the list of removed files.
+static int
+file_release_later(struct File *f, const char *name)
+{
+    struct File *g;
+    int r;
+
+    if (nremoved == NREMOVED)
+        removed_release();
+    if (nremoved == NREMOVED)
+        return -E_MAX_OPEN;
+    if ((r = alloc_file(&g)) < 0)
+        return r;
+    memcpy(g, f, sizeof(struct File));
+    strcpy(g->f_name, name);
+    flush_block(g);
+    file_open_move(f, g);
+    removed[nremoved++] = g;
+    return 0;
+}
+
+// Free what the head f, named name, leaves behind once it is removed
+// from its directory: its blocks and, once nothing else leads to it,
+// its history.  If it is open, that waits until it is closed.  A
+// directory takes the files in its blocks with it, except in those its
+// previous version shares, whose files that version keeps.  The old
+// version of f's directory may keep a copy of f, but only f's history
+// is ever read through it (see walk_path).
+static int
+file_release(struct File *f, const char *name)
+{
+    struct File *e;
+    uint32_t slot, b;
+    int r;
+
+    if (file_is_open(f))
+        return file_release_later(f, name);
+    if (f->f_type == FTYPE_DIR)
+        for (slot = 0; slot < f->f_size / sizeof(struct File); slot++) {
+            b = version_bno(f, slot / BLKFILES);
+            if (!b || b == version_bno(f->f_next_file, slot / BLKFILES))
+                continue;
+            e = (struct File *) diskaddr(b) + slot % BLKFILES;
+            if (!e->f_name[0])
+                continue;
+            dcache_invalidate(e);
+            flush_queue_drop(e);
+            compact_forget(e);
+            if ((r = file_release(e, e->f_name)) < 0)
+                return r;
+        }
+    if ((r = file_free_tail(f, 0)) < 0)
+        return r;
+    history_release(f);
+    return 0;
 }
 
 int
@@ -621,25 +2555,390 @@ file_remove(const char *path)
 {
     int r;
     struct File *dir, *f;
+    char name[MAXNAMELEN];
 
+    // Old versions can't be removed, only dropped by the policy
+    if (strchr(path, '@'))
+        return -E_BAD_PATH;
     time_t timestamp = sys_time_msec();
     if ((r = walk_path(path, &dir, &f, NULL)) < 0)
         return r;
     if (dir == NULL)
         return -E_BAD_PATH;
-    dir_remove_file(dir, f);
+    dcache_invalidate(dir);
+    dcache_invalidate(f);
+    flush_queue_drop(f);
+    compact_forget(f);
+    bc_owner = dir;
+    // Removing f from dir may clear its name
+    strcpy(name, f->f_name);
+    if ((r = dir_remove_file(dir, f)) < 0 ||
+        (r = file_release(f, name)) < 0)
+        return r;
 
     file_flush(dir, timestamp);
     return 0;
 }
 
+// Make the file "path@time" names the current version of its file
+// again, by pointing the head at the old version's blocks and flushing
+// it.  Only blocks stored as deltas or compressed, and blocks whose
+// reference count is full, are copied.  The new pointers are built
+// apart from the head, so that on error it is left as it was.
+int
+file_revert(const char *path)
+{
+    static struct File rv;
+    char headpath[MAXPATHLEN];
+    struct File *f, *v;
+    uint32_t i, n, b, *p;
+    char *blk;
+    int r;
+
+    if (strlen(path) >= MAXPATHLEN || !strchr(path, '@'))
+        return -E_BAD_PATH;
+    strcpy(headpath, path);
+    *strchr(headpath, '@') = '\0';
+    if ((r = walk_path(path, NULL, &v, NULL)) < 0 ||
+            (r = walk_path(headpath, NULL, &f, NULL)) < 0)
+        return r;
+    if (f->f_type != FTYPE_REG || v->f_type != FTYPE_REG)
+        return -E_INVAL;
+    if (v == f)
+        return 0;
+
+    bc_owner = f;
+    memset(&rv, 0, sizeof(rv));
+    rv.f_type = FTYPE_REG;
+    n = ROUNDUP(v->f_size, BLKSIZE) / BLKSIZE;
+    for (i = version_scan(v, NULL, NULL, 0); i < n;
+         i = version_scan(v, NULL, NULL, i + 1)) {
+        if (!(b = version_bno(v, i)))
+            continue;
+        // The previous version's blocks are shared with the head as
+        // usual, any other whole block through its reference count
+        if ((r = file_block_walk(&rv, i, &p, 1)) < 0)
+            goto fail;
+        if (BLKPTR_ISDELTA(b) ||
+                (b != version_bno(f->f_next_file, i) && block_ref(b) < 0)) {
+            if ((r = file_get_block(v, i, &blk)) < 0 ||
+                    (r = alloc_block_near(file_block_goal(&rv, i))) < 0)
+                goto fail;
+            memmove(diskaddr(r), blk, BLKSIZE);
+            *p = r;
+        } else {
+            *p = b;
+            fs_stats.st_revert_blocks++;
+        }
+    }
+
+    // A block the head shares with v is only unreferenced here, since
+    // rv holds a reference of its own
+    if ((r = file_free_tail(f, 0)) < 0)
+        goto fail;
+    memmove(f->f_direct, rv.f_direct, sizeof(f->f_direct));
+    f->f_indirect = rv.f_indirect;
+    f->f_dindirect = rv.f_dindirect;
+    f->f_size = v->f_size;
+    f->f_dirty = true;
+    flush_block(f);
+    file_flush(f, sys_time_msec());
+    return 0;
+
+fail:
+    version_free_blocks(f->f_next_file, &rv, NULL);
+    return r;
+}
+
 
 // Sync the entire file system.  A big hammer.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+    fs_flush_pending(true);
+    journal_commit();
+}
+
+
+// --------------------------------------------------------------
+// Garbage collection
+// --------------------------------------------------------------
+
+// fs_gc sweeps the directory tree a few steps at a time, dropping the
+// old versions of each file that the retention policy in the super
+// block does not keep and freeing what only they used.  Each file's
+// newest old version is always kept, since the head is copied on write
+// against it, and so are versions open in the server.  The sweep keeps
+// its place as slot numbers from the root rather than as pointers,
+// because copying a directory block on write moves the File structures
+// in it.  A new sweep starts GC_PERIOD ms after the last one ended, or
+// as soon as the policy changes.
+#define GC_MAXDEPTH	32
+#define GC_PERIOD	60000
+
+enum { GC_START, GC_THIN, GC_DONE };
+
+static bool gc_active, gc_wanted;
+static time_t gc_last;		// when the last sweep ended
+static uint32_t gc_slots[GC_MAXDEPTH];	// path to the file the sweep is at
+static int gc_depth;
+static int gc_phase;		// progress on that file
+static uint32_t gc_ident;	// its version index, to spot a new file
+static struct File *gc_prev;	// its last version kept so far
+static uint32_t gc_rule;	// rule and period gc_prev was kept for
+static uint64_t gc_period;
+
+// Set the retention policy to the n rules in rules, which must be in
+// order of age with only the last one unlimited.
+// Returns 0 on success, -E_INVAL if the rules are bad.
+int
+fs_set_retention(const struct Retention *rules, int n)
+{
+    int i;
+
+    if (n < 0 || n > NRETAIN)
+        return -E_INVAL;
+    for (i = 1; i < n; i++)
+        if (!rules[i - 1].rt_age ||
+                (rules[i].rt_age && rules[i].rt_age <= rules[i - 1].rt_age))
+            return -E_INVAL;
+    memmove(super->s_retain, rules, n * sizeof(*rules));
+    super->s_nretain = n;
+    flush_block(super);
+    gc_wanted = true;
+    return 0;
+}
+
+// Decide whether the policy keeps version v, given that the last
+// version kept was for rule gc_rule and period gc_period.
+static bool
+gc_keep(struct File *v, time_t now)
+{
+    struct Retention *rt = NULL;
+    uint64_t age, period;
+    uint32_t i;
+
+    age = v->f_timestamp < now ? (now - v->f_timestamp) / 1000 : 0;
+    for (i = 0; i < super->s_nretain; i++) {
+        rt = &super->s_retain[i];
+        if (!rt->rt_age || age <= rt->rt_age)
+            break;
+    }
+    if (i == super->s_nretain)
+        return false;
+    period = rt->rt_interval ?
+        v->f_timestamp / (rt->rt_interval * (uint64_t) 1000) : 0;
+    if (rt->rt_interval && i == gc_rule && period == gc_period)
+        return false;
+    gc_rule = i;
+    gc_period = period;
+    return true;
+}
+
+// Replace the delta record *p for version u's i'th block, whose base
+// is about to go away, with the whole block: compressed if it will
+// compress, in a block of its own if not.
+static int
+version_rebase(struct File *u, uint32_t i, uint32_t *p)
+{
+    static uint8_t buf[sizeof(struct DeltaRec) + LZ_MAXSIZE];
+    struct DeltaRec *dr = (struct DeltaRec *) buf;
+    uint32_t old = *p;
+    char *blk;
+    int len, r;
+
+    if ((r = delta_read(u, i, old, &blk)) < 0)
+        return r;
+    if ((len = lz_compress(blk, dr + 1, LZ_MAXSIZE)) >= 0) {
+        dr->dr_len = len + sizeof(*dr);
+        dr->dr_depth = 0;
+        dr->dr_flags = DR_LZ;
+        if ((r = delta_store(buf, dr->dr_len, p)) < 0)
+            return r;
+    } else {
+        if ((r = alloc_block()) < 0)
+            return r;
+        memmove(diskaddr(r), blk, BLKSIZE);
+        *p = r;
+    }
+    delta_release(old);
+    return 0;
+}
+
+// Remove the entries the garbage collector left in version index
+// vindex, and free the entry blocks no longer needed.
+static void
+version_index_compact(uint32_t vindex)
+{
+    struct VersionIndex *vi = diskaddr(vindex);
+    struct VersionEntry *ve;
+    uint32_t i, n = 0;
+
+    for (i = 0; i < vi->vi_nentries; i++) {
+        ve = version_entry(vi, i);
+        if (ve->ve_file)
+            *version_entry(vi, n++) = *ve;
+    }
+    vi->vi_nentries = n;
+    for (i = (n + NVENTRIES - 1) / NVENTRIES;
+            i < NVBLOCKS && vi->vi_blocks[i]; i++) {
+        free_block(vi->vi_blocks[i]);
+        vi->vi_blocks[i] = 0;
+    }
+}
+
+// Drop version v of file f, the version after u, and free the blocks
+// and records that neither u nor the version after v uses.
+// Returns the number freed, or < 0 on error.
+static int
+version_drop(struct File *f, struct File *u, struct File *v)
+{
+    struct File *w = v->f_next_file;
+    struct VersionIndex *vi;
+    uint32_t i, *pu;
+    int r, nfreed;
+
+    bc_owner = f;
+
+    // u's deltas are against v's blocks: first rebuild those whose
+    // base will change.
+    for (i = version_scan(u, v, NULL, 0); i < MAXFILEBLKS;
+         i = version_scan(u, v, NULL, i + 1)) {
+        if (file_block_walk(u, i, &pu, 0) < 0 || !BLKPTR_ISDELTA(*pu) ||
+                (delta_rec(*pu)->dr_flags & DR_LZ) ||
+                version_bno(v, i) == version_bno(w, i))
+            continue;
+        if ((r = version_rebase(u, i, pu)) < 0)
+            return r;
+    }
+
+    nfreed = version_free_blocks(u, v, w);
+
+    u->f_next_file = w;
+    if (f->f_vindex) {
+        vi = diskaddr(f->f_vindex);
+        if ((r = version_position(vi, v)) >= 0) {
+            version_entry(vi, r)->ve_file = NULL;
+            gc_vindex = f->f_vindex;
+        }
+    }
+    version_forget(v);
+
+    fs_stats.st_gc_versions++;
+    fs_stats.st_gc_blocks += nfreed;
+    return nfreed;
+}
+
+// Thin the history of f, the file the sweep is at, looking at about n
+// versions.  Returns the work done.
+static int
+gc_thin(struct File *f, int n, time_t now)
+{
+    struct File *v;
+    int work = 0, r;
+
+    // The slot may hold another file by now
+    if (gc_phase == GC_THIN && f->f_vindex != gc_ident)
+        gc_phase = GC_START;
+    if (gc_phase == GC_START) {
+        if (gc_vindex)
+            version_index_compact(gc_vindex);
+        gc_vindex = 0;
+        gc_phase = GC_THIN;
+        gc_ident = f->f_vindex;
+        gc_prev = f->f_next_file;
+        gc_rule = ~0;
+        if (gc_prev)
+            gc_keep(gc_prev, now);
+    }
+
+    while (gc_prev && work < n && (v = gc_prev->f_next_file)) {
+        work++;
+        if (gc_keep(v, now) || file_is_open(v) ||
+                version_holds_open(gc_prev, v, v->f_next_file) ||
+                (r = version_drop(f, gc_prev, v)) < 0)
+            gc_prev = v;
+        else
+            work += r / NDIRECT;
+    }
+
+    if (!gc_prev || !gc_prev->f_next_file) {
+        if (gc_vindex)
+            version_index_compact(gc_vindex);
+        gc_vindex = 0;
+        gc_phase = GC_DONE;
+    }
+    return work;
+}
+
+// Return the File structure the sweep is at, or NULL if its slot is
+// past the end of its directory or the directory is gone.
+static struct File *
+gc_file(void)
+{
+    struct File *f = &super->s_root;
+    char *blk;
+    int i;
+
+    for (i = 0; i < gc_depth; i++) {
+        if (f->f_type != FTYPE_DIR ||
+                gc_slots[i] >= f->f_size / sizeof(struct File) ||
+                file_get_block(f, gc_slots[i] / BLKFILES, &blk) < 0)
+            return NULL;
+        f = (struct File *) blk + gc_slots[i] % BLKFILES;
+    }
+    return f;
 }
 
+// Move the sweep on to the next slot of the current directory.
+static void
+gc_next(time_t now)
+{
+    gc_phase = GC_START;
+    if (gc_depth == 0) {
+        gc_active = false;
+        gc_last = now;
+    } else
+        gc_slots[gc_depth - 1]++;
+}
+
+// Do about n steps of garbage collection.
+// Returns true if a sweep is still under way.
+bool
+fs_gc(int n)
+{
+    time_t now = sys_time_msec();
+    struct File *f;
+
+    if (nremoved)
+        removed_release();
+    if (!super->s_nretain)
+        return false;
+    if (!gc_active) {
+        if (!gc_wanted && now - gc_last < GC_PERIOD)
+            return false;
+        gc_active = true;
+        gc_wanted = false;
+        gc_depth = 0;
+        gc_phase = GC_START;
+    }
+
+    while (n > 0 && gc_active) {
+        f = gc_file();
+        if (f && f->f_name[0] && gc_phase != GC_DONE) {
+            n -= MAX(gc_thin(f, n, now), 1);
+            continue;
+        }
+        if (!f) {
+            gc_depth--;
+            gc_next(now);
+        } else if (f->f_name[0] && f->f_type == FTYPE_DIR &&
+                   gc_depth < GC_MAXDEPTH) {
+            gc_slots[gc_depth++] = 0;
+            gc_phase = GC_START;
+        } else
+            gc_next(now);
+        n--;
+    }
+    return gc_active;
+}
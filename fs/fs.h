@@ -11,8 +11,20 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Most blocks read with one disk command (ide_read's 256 sectors) */
+#define BC_MAXRUN	(256 / BLKSECTS)
+
+/* Default and largest number of blocks kept in the block cache */
+#define BC_BUDGET	2048
+#define BC_MAXSLOTS	16384
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+uint32_t bc_budget;		// blocks the block cache may hold
+void *bc_owner;			// file that blocks written now belong to
+bool delta_enabled;		// store old blocks as deltas (fs.c)
+bool compact_enabled;		// compress old blocks (fs.c)
+struct FsStats fs_stats;		// counters reported by FSREQ_STATS
 
 /* ide.c */
 bool	ide_probe_disk1(void);
@@ -20,31 +32,77 @@ void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+int	ide_read_start(uint32_t secno, void *dst, size_t nsecs);
+bool	ide_read_done(void);
+int	ide_finish(void);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_flush_owner(void *owner);
+void	bc_sync(void);
+int	bc_read_run(uint32_t blockno, uint32_t n);
+int	bc_read_async(uint32_t blockno, uint32_t n, uint32_t ra);
+void	bc_async_finish(bool wait);
+void	bc_ra_use(uint32_t blockno);
 void	bc_init(void);
 
+/* journal.c */
+bool	journal_in_place(uint32_t blockno);
+void	journal_dirty(uint32_t blockno);
+int	journal_write(const uint32_t *blocks, uint32_t n);
+void	journal_commit(void);
+void	journal_poll(void);
+int	journal_delay(void);
+void	journal_init(void);
+
+/* lz.c */
+int	lz_compress(const void *src, void *dst, int max);
+int	lz_decompress(const void *src, int len, void *dst);
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, bool isdir, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+int	file_read_ready(struct File *f, size_t count, off_t offset, int nra);
+int	file_map_block(struct File *f, uint32_t filebno, char **blk);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_history(struct File *f, time_t *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f, time_t timestamp);
+void	file_flush_later(struct File *f, time_t timestamp);
+void	fs_flush_pending(bool force);
+int	fs_flush_delay(void);
 int	file_remove(const char *path);
+int	file_revert(const char *path);
 void	fs_sync(void);
+int	fs_compact(int n);
+int	fs_set_retention(const struct Retention *rules, int n);
+bool	fs_gc(int n);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
+void	mark_block_used(uint32_t blockno);
+void	free_block(uint32_t blockno);
+uint32_t	block_refs(uint32_t blockno);
+int	block_ref(uint32_t blockno);
+uint32_t	block_fingerprint(const void *blk);
+int	claim_free_block(void);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
+void	bitmap_rebuild(void);
+uint32_t	bitmap_free_count(void);
+
+/* serv.c */
+bool	file_is_open(struct File *f);
+void	file_open_move(struct File *f, struct File *to);
 
 /* test.c */
 void	fs_test(void);
+void	fs_bench_alloc(void);
+void	fs_bench_delta(void);
 
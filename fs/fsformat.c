@@ -117,6 +117,17 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// Reference counts and fingerprints start out empty: the disk
+	// was just truncated, so alloc's blocks are zero.
+	super->s_nrefmap = (nblocks + BLKREFS - 1) / BLKREFS;
+	super->s_refmap = blockof(alloc(super->s_nrefmap * BLKSIZE));
+	super->s_nfpmap = (nblocks / 4 + BLKFPS - 1) / BLKFPS;
+	super->s_fpmap = blockof(alloc(super->s_nfpmap * BLKSIZE));
+
+	// A zero header means there is nothing to replay
+	super->s_njournal = nblocks / 16 < NJOURNAL ? nblocks / 16 : NJOURNAL;
+	super->s_journal = blockof(alloc(super->s_njournal * BLKSIZE));
 }
 
 void
@@ -192,7 +203,8 @@ writefile(struct Dir *dir, const char *name)
 		panic("stat %s: %s", name, strerror(errno));
 	if (!S_ISREG(st.st_mode))
 		panic("%s is not a regular file", name);
-	if (st.st_size >= MAXFILESIZE)
+	// finishfile only fills in the single indirect block
+	if (st.st_size >= (NDIRECT + NINDIRECT) * BLKSIZE)
 		panic("%s too large", name);
 
 	last = strrchr(name, '/');
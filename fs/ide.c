@@ -1,7 +1,12 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
- * For information about what all this IDE/ATA magic means,
- * see the materials available on the class references page.
+ * Minimal IDE driver code.  Transfers use bus-master DMA when the
+ * kernel found a PCI IDE controller, and PIO otherwise.  The disk
+ * interrupt is delivered to us as an IPC from the kernel, which a DMA
+ * transfer sleeps until.  A DMA read can also be left running in the
+ * background (ide_read_start), and its interrupt then wakes serve.
+ *
+ * For information about what all this IDE/ATA magic means, see the
+ * materials available on the class references page.
  */
 
 #include "fs.h"
@@ -12,7 +17,34 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+// Bus-master IDE registers, relative to the base in PCI BAR 4
+#define BM_CMD		0	// command register
+#define BM_STATUS	2	// status register
+#define BM_PRDT		4	// physical address of the PRD table
+
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08	// transfer from the device into memory
+#define BM_STATUS_ACTIVE	0x01
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_INTR	0x04
+
+// Physical region descriptor: one physically contiguous piece of a
+// transfer.  A region may not cross a 64KB boundary, which a piece
+// within one page never does.
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_count;	// bytes; 0 means 64KB
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// last descriptor of the table
+
+// The largest transfer, 256 sectors, spans at most this many pages
+#define NPRD		(256 * SECTSIZE / PGSIZE + 1)
+
 static int diskno = 1;
+static int bm_base = -1;	// < 0 until probed, 0 if there is no DMA
+static bool dma_busy;		// a background read is in flight
+static struct Prd prdt[NPRD] __attribute__((aligned(PGSIZE)));
 
 static int
 ide_wait_ready(bool check_error)
@@ -60,13 +92,58 @@ ide_set_disk(int d)
 }
 
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+// Return the physical address behind va, or 0 if it is not mapped.
+static physaddr_t
+va2pa(const void *va)
 {
-	int r;
+	if (!(uvpd[PDX(va)] & PTE_P) || !(uvpt[PGNUM(va)] & PTE_P))
+		return 0;
+	return PTE_ADDR(uvpt[PGNUM(va)]) | PGOFF(va);
+}
 
-	assert(nsecs <= 256);
+// Fill in the PRD table for a transfer of n bytes at va.
+// Returns 0 on success, or -E_INVAL if part of the buffer is not mapped,
+// in which case the caller falls back to PIO.
+static int
+ide_dma_setup(const void *va, size_t n)
+{
+	int i, r;
+	size_t len;
+	physaddr_t pa;
+
+	if (bm_base < 0) {
+		bm_base = sys_ide_bm_base();
+		if (bm_base < 0)
+			bm_base = 0;
+		else if ((r = sys_irq_listen(IRQ_IDE)) < 0)
+			panic("sys_irq_listen: %e", r);
+	}
+	if (bm_base == 0)
+		return -E_NOT_SUPP;
 
+	// Make sure the PRD table itself is backed by a page
+	prdt[0].prd_flags = 0;
+	for (i = 0; n > 0; i++, va += len, n -= len) {
+		len = MIN(n, PGSIZE - PGOFF(va));
+		if ((pa = va2pa(va)) == 0)
+			return -E_INVAL;
+		prdt[i].prd_addr = pa;
+		prdt[i].prd_count = len;
+		prdt[i].prd_flags = 0;
+	}
+	prdt[i - 1].prd_flags = PRD_EOT;
+
+	outb(bm_base + BM_CMD, 0);
+	outl(bm_base + BM_PRDT, va2pa(prdt));
+	// Writing 1s clears the error and interrupt bits
+	outb(bm_base + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+	return 0;
+}
+
+// Issue ATA command cmd for nsecs sectors starting at secno.
+static void
+ide_command(uint32_t secno, size_t nsecs, uint8_t cmd)
+{
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -74,7 +151,87 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F7, cmd);
+}
+
+// Has the running DMA transfer finished?
+static bool
+ide_dma_done(void)
+{
+	return (inb(bm_base + BM_STATUS) &
+		(BM_STATUS_ACTIVE | BM_STATUS_INTR)) != BM_STATUS_ACTIVE;
+}
+
+// Wait for the running DMA transfer to finish, sleeping until the disk
+// interrupt rather than polling, and stop the DMA engine.  Requests that
+// arrive meanwhile stay queued for serve.  An interrupt left over from
+// an earlier transfer only costs another look at the status.
+static int
+ide_dma_wait(void)
+{
+	int status;
+
+	while (!ide_dma_done())
+		ipc_recv(NULL, NULL, NULL, ENVID_IRQ);
+	status = inb(bm_base + BM_STATUS);
+	outb(bm_base + BM_CMD, 0);
+	outb(bm_base + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+
+	if (status & BM_STATUS_ERR)
+		return -1;
+	return ide_wait_ready(1);
+}
+
+// Start reading nsecs sectors at secno into dst with DMA, and return
+// without waiting for the data.  ide_finish completes the read.
+// Returns 0 on success, < 0 if DMA cannot be used for this read.
+int
+ide_read_start(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256 && !dma_busy);
+
+	if ((r = ide_dma_setup(dst, nsecs * SECTSIZE)) < 0)
+		return r;
+	ide_command(secno, nsecs, 0xC8);	// CMD 0xC8 means read DMA
+	outb(bm_base + BM_CMD, BM_CMD_READ | BM_CMD_START);
+	dma_busy = true;
+	return 0;
+}
+
+// Has the read started by ide_read_start finished?
+bool
+ide_read_done(void)
+{
+	return !dma_busy || ide_dma_done();
+}
+
+// Wait for the read started by ide_read_start to finish.
+// Returns 0 on success, < 0 on a disk error.
+int
+ide_finish(void)
+{
+	if (!dma_busy)
+		return 0;
+	dma_busy = false;
+	return ide_dma_wait();
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256 && !dma_busy);
+
+	if (ide_dma_setup(dst, nsecs * SECTSIZE) == 0) {
+		ide_command(secno, nsecs, 0xC8);	// CMD 0xC8 means read DMA
+		outb(bm_base + BM_CMD, BM_CMD_READ | BM_CMD_START);
+		return ide_dma_wait();
+	}
+
+	ide_command(secno, nsecs, 0x20);	// CMD 0x20 means read sector
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -90,16 +247,15 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 {
 	int r;
 
-	assert(nsecs <= 256);
+	assert(nsecs <= 256 && !dma_busy);
 
-	ide_wait_ready(0);
+	if (ide_dma_setup(src, nsecs * SECTSIZE) == 0) {
+		ide_command(secno, nsecs, 0xCA);	// CMD 0xCA means write DMA
+		outb(bm_base + BM_CMD, BM_CMD_START);
+		return ide_dma_wait();
+	}
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	ide_command(secno, nsecs, 0x30);	// CMD 0x30 means write sector
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
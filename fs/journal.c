@@ -0,0 +1,222 @@
+#include "fs.h"
+
+// Write-ahead journal.  Between commits nothing the last commit left
+// in use is written in place: those blocks stay dirty in the cache, and
+// bc_sync writes them to the journal, then the header that commits
+// them, and only then to their homes.  A crash at any point leaves
+// either the old state or, once fs_init replays the journal, the new
+// one.  Blocks the last commit left free may be written at any time,
+// since nothing on disk points at them yet; bc_sync writes those first,
+// so a committed block pointer never names a block still being written.
+//
+// A transaction is everything one request changed.  Requests end with
+// the file system consistent, so the server groups the transactions of
+// many requests into one commit: journal_poll commits once the oldest
+// has waited JOURNAL_DELAY ms, or once they fill half the journal.  An
+// idle server waits for its next request only until then (see
+// journal_delay), since nothing else would wake it to commit.  A
+// request that changes more than the journal holds is written in place
+// like before, and is not atomic.
+#define JOURNAL_DELAY	50
+
+// Staging pages for the images, below bc.c's
+#define JSTAGE		(DISKMAP - (2 * BC_MAXRUN + 1) * PGSIZE)
+
+static bool jn_active;		// the disk has a journal and it is replayed
+static uint32_t jn_seq;		// commits so far
+static uint32_t jn_pending;	// blocks waiting for the next commit
+static uint32_t jn_polled;	// jn_pending at the last journal_poll
+static uint32_t jn_ntxn;	// requests waiting for the next commit
+static time_t jn_since;		// when the oldest of them ended
+
+// The bitmap as of the last commit: a block free here may be written
+// in place.
+static uint32_t jn_bitmap[DISKSIZE / BLKSIZE / 32];
+
+static struct JournalHeader jn_header __attribute__((aligned(PGSIZE)));
+static char jn_image[BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+// Checksum the header's block numbers and the images, whose
+// fingerprints are in fps.
+static uint32_t
+journal_checksum(struct JournalHeader *jh, const uint32_t *fps)
+{
+    uint32_t i, h = 2166136261 ^ jh->jh_seq;
+
+    for (i = 0; i < jh->jh_nblocks; i++)
+        h = (h ^ jh->jh_blocknos[i] ^ fps[i]) * 16777619;
+    return h;
+}
+
+// May blockno be written to its home now?
+bool
+journal_in_place(uint32_t blockno)
+{
+    return !jn_active || (jn_bitmap[blockno / 32] & (1 << (blockno % 32)));
+}
+
+// Note that blockno was just written for the first time since it was
+// last flushed.
+void
+journal_dirty(uint32_t blockno)
+{
+    if (!journal_in_place(blockno))
+        jn_pending++;
+}
+
+// Note that the bitmap blocks among the n blocks in blocks are being
+// written: what they allocate is no longer free to write in place.
+static void
+journal_written(const uint32_t *blocks, uint32_t n)
+{
+    uint32_t i, nbitblocks;
+
+    nbitblocks = (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+    for (i = 0; i < n; i++)
+        if (blocks[i] >= 2 && blocks[i] < 2 + nbitblocks)
+            memmove(&jn_bitmap[(blocks[i] - 2) * BLKSIZE / 4],
+                    diskaddr(blocks[i]), BLKSIZE);
+}
+
+// Write the n blocks in blocks, sorted, to the journal and commit them.
+// They must then be written to their homes.  Returns 0 on success, or
+// -E_NO_DISK if they do not fit; they must then be written in place all
+// the same.
+int
+journal_write(const uint32_t *blocks, uint32_t n)
+{
+    static uint32_t fps[JH_MAXBLKS];
+    struct JournalHeader *jh = &jn_header;
+    uint32_t i, j, k;
+    int r;
+
+    if (!jn_active)
+        return -E_NO_DISK;
+    if (n > super->s_njournal - 1 || n > JH_MAXBLKS) {
+        journal_written(blocks, n);
+        return -E_NO_DISK;
+    }
+
+    // Map the blocks side by side so that the images go out in as few
+    // disk commands as possible
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && j - i < BC_MAXRUN; j++) {
+            if ((r = sys_page_map(0, diskaddr(blocks[j]), 0,
+                            (void *) JSTAGE + (j - i) * PGSIZE,
+                            PTE_U | PTE_P)) < 0)
+                panic("in journal_write, sys_page_map: %e", r);
+            jh->jh_blocknos[j] = blocks[j];
+            fps[j] = block_fingerprint(diskaddr(blocks[j]));
+        }
+        if ((r = ide_write((super->s_journal + 1 + i) * BLKSECTS,
+                        (void *) JSTAGE, (j - i) * BLKSECTS)) < 0)
+            panic("in journal_write, ide_write: %e", r);
+        for (k = 0; k < j - i; k++)
+            sys_page_unmap(0, (void *) JSTAGE + k * PGSIZE);
+    }
+
+    jh->jh_magic = JOURNAL_MAGIC;
+    jh->jh_seq = jn_seq++;
+    jh->jh_nblocks = n;
+    jh->jh_checksum = journal_checksum(jh, fps);
+    if ((r = ide_write(super->s_journal * BLKSECTS, jh, BLKSECTS)) < 0)
+        panic("in journal_write, ide_write: %e", r);
+
+    journal_written(blocks, n);
+    fs_stats.st_journal_commits++;
+    fs_stats.st_journal_blocks += n;
+    return 0;
+}
+
+// Commit everything written so far.
+void
+journal_commit(void)
+{
+    bc_sync();
+    fs_stats.st_journal_txns += jn_ntxn;
+    jn_pending = jn_polled = jn_ntxn = 0;
+}
+
+// Note the end of a request, and commit the requests so far if they
+// have waited long enough or are filling the journal.
+void
+journal_poll(void)
+{
+    time_t now = sys_time_msec();
+
+    if (!jn_active)
+        return;
+    if (jn_pending > jn_polled) {
+        if (!jn_ntxn)
+            jn_since = now;
+        jn_ntxn++;
+        jn_polled = jn_pending;
+    }
+    if (jn_ntxn && (now - jn_since >= JOURNAL_DELAY ||
+                jn_pending >= (super->s_njournal - 1) / 2))
+        journal_commit();
+}
+
+// Return how many ms are left before journal_poll commits the requests
+// so far, or -1 if there are none.
+int
+journal_delay(void)
+{
+    time_t waited;
+
+    if (!jn_active || !jn_ntxn)
+        return -1;
+    waited = sys_time_msec() - jn_since;
+    return waited >= JOURNAL_DELAY ? 0 : JOURNAL_DELAY - waited;
+}
+
+// Replay the last transaction if it may not have reached its home
+// blocks, and start journaling.  Called once the super block is
+// checked and before anything else is read.
+void
+journal_init(void)
+{
+    static uint32_t fps[JH_MAXBLKS];
+    struct JournalHeader *jh = &jn_header;
+    uint32_t i, nbitblocks;
+    int r;
+
+    if (super->s_njournal < 2)
+        return;
+    if ((r = ide_read(super->s_journal * BLKSECTS, jh, BLKSECTS)) < 0)
+        panic("in journal_init, ide_read: %e", r);
+    jn_seq = jh->jh_magic == JOURNAL_MAGIC ? jh->jh_seq + 1 : 0;
+
+    if (jh->jh_magic == JOURNAL_MAGIC && jh->jh_nblocks < super->s_njournal &&
+            jh->jh_nblocks <= JH_MAXBLKS) {
+        for (i = 0; i < jh->jh_nblocks; i++) {
+            if ((r = ide_read((super->s_journal + 1 + i) * BLKSECTS,
+                            jn_image, BLKSECTS)) < 0)
+                panic("in journal_init, ide_read: %e", r);
+            fps[i] = block_fingerprint(jn_image);
+        }
+        // A header written over an older one whose images were already
+        // overwritten has a checksum that does not match
+        if (journal_checksum(jh, fps) == jh->jh_checksum) {
+            for (i = 0; i < jh->jh_nblocks; i++) {
+                if (jh->jh_blocknos[i] == 0 ||
+                        jh->jh_blocknos[i] >= super->s_nblocks)
+                    panic("journal names bad block %08x", jh->jh_blocknos[i]);
+                if ((r = ide_read((super->s_journal + 1 + i) * BLKSECTS,
+                                jn_image, BLKSECTS)) < 0)
+                    panic("in journal_init, ide_read: %e", r);
+                memmove(diskaddr(jh->jh_blocknos[i]), jn_image, BLKSIZE);
+                flush_block(diskaddr(jh->jh_blocknos[i]));
+            }
+            fs_stats.st_journal_replays++;
+            cprintf("journal: replayed %d blocks\n", jh->jh_nblocks);
+        }
+        jh->jh_magic = 0;
+        if ((r = ide_write(super->s_journal * BLKSECTS, jh, BLKSECTS)) < 0)
+            panic("in journal_init, ide_write: %e", r);
+    }
+
+    nbitblocks = (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+    memmove(jn_bitmap, diskaddr(2), nbitblocks * BLKSIZE);
+    jn_active = true;
+}
@@ -0,0 +1,156 @@
+#include "fs.h"
+
+// A small LZ77 codec for whole blocks, in the style of LZ4: the output
+// is a series of sequences, each a token byte, a run of literal bytes
+// and a match to copy from earlier in the block.  The token's high four
+// bits hold the number of literals and its low four the match length
+// minus LZ_MINMATCH; a field of 15 continues in the following bytes,
+// 255 at a time.  A match is a 2-byte little-endian offset back from
+// the current position.  The last sequence has literals only.
+#define LZ_MINMATCH	4
+#define LZ_HASHBITS	10
+#define LZ_NOPOS	0xFFFF
+
+static uint32_t
+lz_hash(const uint8_t *p)
+{
+    uint32_t v = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+    return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+// Append the remainder n of a length field.
+static uint8_t *
+lz_putlen(uint8_t *op, uint8_t *oend, int n)
+{
+    for (; n >= 255; n -= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = n;
+    return op;
+}
+
+// Append a sequence of nlit literals and a match of mlen bytes off
+// bytes back, or literals only if mlen is 0.  Returns the end of the
+// output, or NULL if it would go past oend.
+static uint8_t *
+lz_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, int nlit,
+            int off, int mlen)
+{
+    uint8_t *token;
+
+    if (op >= oend)
+        return NULL;
+    token = op++;
+    *token = MIN(nlit, 15) << 4;
+    if (nlit >= 15 && !(op = lz_putlen(op, oend, nlit - 15)))
+        return NULL;
+    if (nlit > oend - op)
+        return NULL;
+    memmove(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = off;
+    *op++ = off >> 8;
+    mlen -= LZ_MINMATCH;
+    *token |= MIN(mlen, 15);
+    if (mlen >= 15 && !(op = lz_putlen(op, oend, mlen - 15)))
+        return NULL;
+    return op;
+}
+
+// Compress the block at src into at most max bytes at dst.
+// Returns the compressed size, or -1 if it does not fit.
+int
+lz_compress(const void *src, void *dst, int max)
+{
+    static uint16_t table[1 << LZ_HASHBITS];
+    const uint8_t *base = src, *end = base + BLKSIZE;
+    const uint8_t *ip = base, *anchor = base, *ref;
+    uint8_t *op = dst, *oend = op + max;
+    uint32_t h, pos;
+    int mlen;
+
+    memset(table, 0xFF, sizeof(table));
+    while (end - ip >= LZ_MINMATCH) {
+        h = lz_hash(ip);
+        pos = table[h];
+        table[h] = ip - base;
+        ref = base + pos;
+        if (pos == LZ_NOPOS || memcmp(ref, ip, LZ_MINMATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        for (mlen = LZ_MINMATCH; ip + mlen < end && ref[mlen] == ip[mlen];
+             mlen++)
+            ;
+        if (!(op = lz_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen)))
+            return -1;
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!(op = lz_sequence(op, oend, anchor, end - anchor, 0, 0)))
+        return -1;
+    return op - (uint8_t *) dst;
+}
+
+// Read the rest of a length field whose token bits were n.
+static int
+lz_getlen(const uint8_t **ip, const uint8_t *iend, int n)
+{
+    int b;
+
+    if (n < 15)
+        return n;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        n += b;
+    } while (b == 255);
+    return n;
+}
+
+// Decompress the len bytes at src into the block at dst.
+// Returns the number of bytes produced, or -E_INVAL if src is corrupt.
+int
+lz_decompress(const void *src, int len, void *dst)
+{
+    const uint8_t *ip = src, *iend = ip + len;
+    uint8_t *op = dst, *oend = op + BLKSIZE;
+    int token, n, off;
+
+    while (ip < iend) {
+        token = *ip++;
+        if ((n = lz_getlen(&ip, iend, token >> 4)) < 0 ||
+            n > iend - ip || n > oend - op)
+            return -E_INVAL;
+        memmove(op, ip, n);
+        op += n;
+        ip += n;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -E_INVAL;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if ((n = lz_getlen(&ip, iend, token & 15)) < 0)
+            return -E_INVAL;
+        n += LZ_MINMATCH;
+        if (off == 0 || off > op - (uint8_t *) dst || n > oend - op)
+            return -E_INVAL;
+        // Byte at a time: the match may overlap what it produces
+        for (; n > 0; n--, op++)
+            *op = op[-off];
+    }
+    return op - (uint8_t *) dst;
+}
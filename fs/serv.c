@@ -34,11 +34,16 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	off_t o_rapos;		// where the next sequential read starts
+	int o_rawin;		// blocks to read ahead of the next read
+	char *o_buf;		// the client's buffer, FSBUFSIZE bytes
+	int o_nbuf;		// pages of it the client has handed over
 };
 
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
+#define FILEBUFVA	(FILEVA + MAXOPEN * PGSIZE)
 
 // initialize to force into data section
 struct OpenFile opentab[MAXOPEN] = {
@@ -48,6 +53,32 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
+// Reads that are waiting for a block to come in from disk.  While one
+// waits, the server goes on answering other requests; each waiting
+// request page is moved from fsreq to its own page at PENDVA.
+#define NPENDING	16
+#define PENDVA		0xE0000000
+
+struct Pending {
+	envid_t p_whom;		// client, or 0 if the slot is free
+	uint32_t p_req;		// request type
+};
+
+struct Pending pending[NPENDING];
+
+// Request rings handed over by clients (see struct FsRing), each on
+// its own page at RINGVA.
+#define NRING		32
+#define RINGVA		(PENDVA + NPENDING * PGSIZE)
+
+envid_t ring_whom[NRING];	// client, or 0 if the slot is free
+
+// Old blocks compressed, and garbage collection steps taken, after each
+// request or disk interrupt once its reply has gone out (see fs_compact
+// and fs_gc).
+#define COMPACT_SLICE	4
+#define GC_SLICE	16
+
 void
 serve_init(void)
 {
@@ -56,10 +87,19 @@ serve_init(void)
 	for (i = 0; i < MAXOPEN; i++) {
 		opentab[i].o_fileid = i;
 		opentab[i].o_fd = (struct Fd*) va;
+		opentab[i].o_buf = (char*) (FILEBUFVA + i * FSBUFSIZE);
 		va += PGSIZE;
 	}
 }
 
+// Unmap the pages of o's buffer.
+static void
+openfile_drop_buf(struct OpenFile *o)
+{
+	for (; o->o_nbuf > 0; o->o_nbuf--)
+		sys_page_unmap(0, o->o_buf + (o->o_nbuf - 1) * PGSIZE);
+}
+
 // Allocate an open file.
 int
 openfile_alloc(struct OpenFile **o)
@@ -77,6 +117,8 @@ openfile_alloc(struct OpenFile **o)
 			opentab[i].o_fileid += MAXOPEN;
 			*o = &opentab[i];
 			memset(opentab[i].o_fd, 0, PGSIZE);
+			// Drop the last client's buffer
+			openfile_drop_buf(&opentab[i]);
 			return (*o)->o_fileid;
 		}
 	}
@@ -96,6 +138,29 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
+// Return true if some client has f open.
+bool
+file_is_open(struct File *f)
+{
+	int i;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file == f && pageref(opentab[i].o_fd) > 1)
+			return true;
+	return false;
+}
+
+// Point the files open on f at to instead.
+void
+file_open_move(struct File *f, struct File *to)
+{
+	int i;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file == f)
+			opentab[i].o_file = to;
+}
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -116,6 +181,15 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	memmove(path, req->req_path, MAXPATHLEN);
 	path[MAXPATHLEN-1] = 0;
 
+	// Old versions are read-only, and versions of files closed lately
+	// must be there to be found
+	if (strchr(path, '@')) {
+		if ((req->req_omode & (O_CREAT | O_TRUNC)) ||
+		    (req->req_omode & O_ACCMODE) != O_RDONLY)
+			return -E_BAD_PATH;
+		fs_flush_pending(true);
+	}
+
 	// Find an open file ID
 	if ((r = openfile_alloc(&o)) < 0) {
 		if (debug)
@@ -164,6 +238,8 @@ try_open:
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
+	o->o_rapos = 0;
+	o->o_rawin = 0;
 
 	if (debug)
 		cprintf("sending success, page %08x\n", (uintptr_t) o->o_fd);
@@ -200,6 +276,21 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	return file_set_size(o->o_file, req->req_size);
 }
 
+// Note that n bytes were just read from o at its seek position, and
+// move the seek position past them.
+static void
+serve_read_done(struct OpenFile *o, int n)
+{
+    // Double the read-ahead window while reads stay sequential
+    if (o->o_fd->fd_offset == o->o_rapos)
+        o->o_rawin = MIN(MAX(2 * o->o_rawin, 1), BC_MAXRUN);
+    else
+        o->o_rawin = 0;
+    o->o_rapos = o->o_fd->fd_offset + n;
+
+    o->o_fd->fd_offset += n;
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -223,10 +314,157 @@ serve_read(envid_t envid, union Fsipc *ipc)
     if (bytes_read < 0)
         return bytes_read;
 
-    o->o_fd->fd_offset += bytes_read;
+    serve_read_done(o, bytes_read);
     return bytes_read;
 }
 
+// Like serve_read, but when the seek position is at the start of a
+// block that can no longer change, share the block cache's page with
+// the caller read-only by setting *pg_store and *perm_store, instead
+// of copying it into ipc->readRet.  Returns the number of bytes of the
+// page, or of ipc->readRet, that were read.
+int
+serve_map_read(envid_t envid, union Fsipc *ipc, void **pg_store,
+	       int *perm_store)
+{
+	struct Fsreq_read *req = &ipc->read;
+	struct OpenFile *o;
+	off_t offset;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	offset = o->o_fd->fd_offset;
+	if (offset % BLKSIZE || offset >= o->o_file->f_size ||
+	    file_map_block(o->o_file, offset / BLKSIZE, &blk) < 0)
+		return serve_read(envid, ipc);
+
+	r = MIN(req->req_n, MIN(BLKSIZE, o->o_file->f_size - offset));
+	serve_read_done(o, r);
+	fs_stats.st_map_reads++;
+	*pg_store = blk;
+	*perm_store = PTE_P | PTE_U;
+	return r;
+}
+
+
+// Take the page of ipc, which is the req_page'th page of the client's
+// buffer for ipc->buffer.req_fileid.  The pages must come in order.
+int
+serve_buffer(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_buffer *req = &ipc->buffer;
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_buffer %08x %08x %d\n", envid, req->req_fileid, req->req_page);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_page < 0 || req->req_page >= FSBUFPAGES ||
+	    (req->req_page != 0 && req->req_page != o->o_nbuf))
+		return -E_INVAL;
+	// A buffer that starts over drops all of the old one
+	if (req->req_page == 0)
+		openfile_drop_buf(o);
+	if ((r = sys_page_map(0, ipc, 0, o->o_buf + req->req_page * PGSIZE,
+			      PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	o->o_nbuf = req->req_page + 1;
+	return 0;
+}
+
+// Read or write at most n bytes at the seek position of fileid,
+// through its buffer from byte off on, and update the seek position.
+// Returns the number of bytes moved, or < 0 on error.
+static int
+serve_buf_io(envid_t envid, int fileid, bool write, uint32_t off, size_t n)
+{
+	struct OpenFile *o;
+	int r;
+
+	if ((r = openfile_lookup(envid, fileid, &o)) < 0)
+		return r;
+	if (o->o_nbuf != FSBUFPAGES || off > FSBUFSIZE)
+		return -E_INVAL;
+	n = MIN(n, FSBUFSIZE - off);
+	if (write) {
+		if ((r = file_write(o->o_file, o->o_buf + off, n,
+				    o->o_fd->fd_offset)) < 0)
+			return r;
+		o->o_fd->fd_offset += r;
+		fs_stats.st_buf_writes++;
+	} else {
+		if ((r = file_read(o->o_file, o->o_buf + off, n,
+				   o->o_fd->fd_offset)) < 0)
+			return r;
+		serve_read_done(o, r);
+		fs_stats.st_buf_reads++;
+	}
+	return r;
+}
+
+// Like serve_read, but read up to FSBUFSIZE bytes into the client's
+// buffer.
+int
+serve_buf_read(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_read *req = &ipc->read;
+
+	if (debug)
+		cprintf("serve_buf_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	return serve_buf_io(envid, req->req_fileid, false, 0, req->req_n);
+}
+
+// Like serve_write, but write up to FSBUFSIZE bytes from the client's
+// buffer.
+int
+serve_buf_write(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_buf_write *req = &ipc->buf_write;
+
+	if (debug)
+		cprintf("serve_buf_write %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	return serve_buf_io(envid, req->req_fileid, true, 0, req->req_n);
+}
+
+static struct FsRing *
+ring_page(int i)
+{
+	return (struct FsRing *) (RINGVA + i * PGSIZE);
+}
+
+// Take the page of ipc as envid's request ring, in place of any it
+// handed over before.
+int
+serve_ring(envid_t envid, union Fsipc *ipc)
+{
+	int i, r, slot = -1;
+
+	if (debug)
+		cprintf("serve_ring %08x\n", envid);
+
+	for (i = 0; i < NRING; i++) {
+		if (ring_whom[i] == envid)
+			break;
+		if (!ring_whom[i] && slot < 0)
+			slot = i;
+	}
+	if (i == NRING && (i = slot) < 0)
+		return -E_NO_MEM;
+	if ((r = sys_page_map(0, ipc, 0, ring_page(i),
+			      PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	ring_whom[i] = envid;
+	return 0;
+}
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -288,10 +526,13 @@ serve_history(envid_t envid, union Fsipc *ipc)
     if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
         return r;
 
+    fs_flush_pending(true);
     return file_history(o->o_file, ret->ret_buf, req->req_n, req->req_offset);
 }
 
-// Flush all data and metadata of req->req_fileid to disk.
+// Make a new version of req->req_fileid.  Files opened with O_SYNC are
+// flushed and committed before the reply; others are queued to be
+// flushed with the next batch.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
 {
@@ -303,7 +544,11 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
-	file_flush(o->o_file, sys_time_msec());
+	if (o->o_mode & O_SYNC) {
+		file_flush(o->o_file, sys_time_msec());
+		fs_sync();
+	} else
+		file_flush_later(o->o_file, sys_time_msec());
 	return 0;
 }
 
@@ -319,6 +564,16 @@ serve_remove(envid_t envid, struct Fsreq_remove *req)
 	return file_remove(req->req_path);
 }
 
+int
+serve_revert(envid_t envid, struct Fsreq_revert *req)
+{
+	if (debug)
+		cprintf("serve_revert %08x %s\n", envid, req->req_path);
+
+	// The version may still be waiting to be flushed
+	fs_flush_pending(true);
+	return file_revert(req->req_path);
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -327,6 +582,42 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	ipc->statsRet.ret_stats = fs_stats;
+	return 0;
+}
+
+int
+serve_retain(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_retain *req = &ipc->retain;
+	int r;
+
+	if (req->req_nrules >= 0 &&
+	    (r = fs_set_retention(req->req_rules, req->req_nrules)) < 0)
+		return r;
+	req->req_nrules = super->s_nretain;
+	memmove(req->req_rules, super->s_retain, sizeof(req->req_rules));
+	return 0;
+}
+
+int
+serve_bench(envid_t envid, union Fsipc *ipc)
+{
+	switch (ipc->bench.req_which) {
+	case FSBENCH_ALLOC:
+		fs_bench_alloc();
+		return 0;
+	case FSBENCH_DELTA:
+		fs_bench_delta();
+		return 0;
+	default:
+		return -E_INVAL;
+	}
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -339,24 +630,267 @@ fshandler handlers[] = {
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
 	[FSREQ_REMOVE] =	(fshandler)serve_remove,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_STATS] =		serve_stats,
+	[FSREQ_RETAIN] =	serve_retain,
+	[FSREQ_REVERT] =	(fshandler)serve_revert,
+	[FSREQ_BUFFER] =	serve_buffer,
+	[FSREQ_BUF_READ] =	serve_buf_read,
+	[FSREQ_BUF_WRITE] =	serve_buf_write,
+	[FSREQ_RING] =		serve_ring,
+	[FSREQ_BENCH] =		serve_bench
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+static union Fsipc *
+pending_ipc(int i)
+{
+	return (union Fsipc *) (PENDVA + i * PGSIZE);
+}
+
+// Can request req from envid be answered without waiting for the disk?
+// If not, the block it waits for is being read in the background.
+static bool
+serve_ready(envid_t envid, uint32_t req, union Fsipc *ipc)
+{
+	struct OpenFile *o;
+	size_t max;
+
+	if ((req != FSREQ_READ && req != FSREQ_MAP_READ &&
+	     req != FSREQ_BUF_READ) ||
+	    openfile_lookup(envid, ipc->read.req_fileid, &o) < 0)
+		return true;
+	max = req == FSREQ_BUF_READ ? FSBUFSIZE : sizeof(ipc->readRet.ret_buf);
+	return file_read_ready(o->o_file, MIN(ipc->read.req_n, max),
+			       o->o_fd->fd_offset, o->o_rawin) != 0;
+}
+
+// Answer request req from whom, whose page is at ipc.  A page to send
+// with the reply is left in *pg and *perm.
+static int
+serve_request(envid_t whom, uint32_t req, union Fsipc *ipc, void **pg,
+	      int *perm)
+{
+	*pg = NULL;
+	if (req == FSREQ_OPEN)
+		return serve_open(whom, (struct Fsreq_open*)ipc, pg, perm);
+	if (req == FSREQ_MAP_READ)
+		return serve_map_read(whom, ipc, pg, perm);
+	if (req < NHANDLERS && handlers[req])
+		return handlers[req](whom, ipc);
+	cprintf("Invalid request code %d from %08x\n", req, whom);
+	return -E_INVAL;
+}
+
+// Put the request in fsreq aside until the disk is done.
+// Returns 0 on success, < 0 if there is no room to wait.
+static int
+pending_add(envid_t envid, uint32_t req)
+{
+	int i, r;
+
+	for (i = 0; i < NPENDING; i++)
+		if (!pending[i].p_whom)
+			break;
+	if (i == NPENDING)
+		return -E_NO_MEM;
+	if ((r = sys_page_map(0, fsreq, 0, pending_ipc(i),
+			      PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	pending[i].p_whom = envid;
+	pending[i].p_req = req;
+	return 0;
+}
+
+// Answer the waiting requests that no longer have to wait.
+static void
+serve_pending(void)
+{
+	int i, r, perm;
+	void *pg;
+
+	for (i = 0; i < NPENDING; i++) {
+		if (!pending[i].p_whom ||
+		    !serve_ready(pending[i].p_whom, pending[i].p_req, pending_ipc(i)))
+			continue;
+		r = serve_request(pending[i].p_whom, pending[i].p_req,
+				  pending_ipc(i), &pg, &perm);
+		ipc_send(pending[i].p_whom, r, pg, perm);
+		sys_page_unmap(0, pending_ipc(i));
+		pending[i].p_whom = 0;
+	}
+}
+
+// Can the queued request sqe from whom be answered without waiting for
+// the disk?  Like serve_ready.
+static bool
+ring_ready(envid_t whom, struct FsSqe *sqe)
+{
+	struct OpenFile *o;
+
+	if (sqe->sqe_op != FSREQ_BUF_READ || sqe->sqe_bufoff > FSBUFSIZE ||
+	    openfile_lookup(whom, sqe->sqe_fileid, &o) < 0)
+		return true;
+	return file_read_ready(o->o_file,
+			       MIN(sqe->sqe_n, FSBUFSIZE - sqe->sqe_bufoff),
+			       o->o_fd->fd_offset, o->o_rawin) != 0;
+}
+
+// Answer the queued request sqe from whom.
+static int
+ring_request(envid_t whom, struct FsSqe *sqe)
+{
+	struct Fsreq_set_size set_size;
+	struct Fsreq_flush flush;
+
+	switch (sqe->sqe_op) {
+	case FSREQ_BUF_READ:
+	case FSREQ_BUF_WRITE:
+		return serve_buf_io(whom, sqe->sqe_fileid,
+				    sqe->sqe_op == FSREQ_BUF_WRITE,
+				    sqe->sqe_bufoff, sqe->sqe_n);
+	case FSREQ_SET_SIZE:
+		set_size.req_fileid = sqe->sqe_fileid;
+		set_size.req_size = sqe->sqe_n;
+		return serve_set_size(whom, &set_size);
+	case FSREQ_FLUSH:
+		flush.req_fileid = sqe->sqe_fileid;
+		return serve_flush(whom, &flush);
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Answer the requests queued in ring i, in order, until it is empty,
+// its completion ring is full, or the next one must wait for the disk.
+// Returns true if any were answered.
+static bool
+ring_serve(int i)
+{
+	struct FsRing *ring = ring_page(i);
+	struct FsSqe sqe;
+	volatile struct FsCqe *cqe;
+	uint32_t n;
+
+	if (!ring_whom[i])
+		return false;
+	// The client is gone
+	if (pageref(ring) <= 1) {
+		sys_page_unmap(0, ring);
+		ring_whom[i] = 0;
+		return false;
+	}
+
+	for (n = 0; ring->r_sq_head != ring->r_sq_tail &&
+		     ring->r_cq_tail - ring->r_cq_head < FSRING_ENTRIES; n++) {
+		sqe = ring->r_sq[ring->r_sq_head % FSRING_ENTRIES];
+		if (!ring_ready(ring_whom[i], &sqe))
+			break;
+		cqe = &ring->r_cq[ring->r_cq_tail % FSRING_ENTRIES];
+		cqe->cqe_data = sqe.sqe_data;
+		cqe->cqe_result = ring_request(ring_whom[i], &sqe);
+		// The completion shows before the request leaves, so that a
+		// client never finds both rings empty in between
+		ring->r_cq_tail++;
+		ring->r_sq_head++;
+	}
+	if (!n)
+		return false;
+	fs_stats.st_ring_requests += n;
+	fs_stats.st_ring_batches++;
+	if (xchg(&ring->r_cq_wait, 0))
+		ipc_send(ring_whom[i], 0, NULL, 0);
+	return true;
+}
+
+// Answer what the rings hold, and mark them so that their clients ring
+// the doorbell for what they queue while the server waits for IPC.  A
+// request queued just before the mark went up is caught by the second
+// look.
+static void
+serve_rings(void)
+{
+	bool answered, any = false;
+	int i;
+
+	do {
+		answered = false;
+		for (i = 0; i < NRING; i++)
+			answered |= ring_serve(i);
+		any |= answered;
+	} while (answered);
+	if (any) {
+		fs_flush_pending(false);
+		journal_poll();
+	}
+
+	for (i = 0; i < NRING; i++)
+		if (ring_whom[i])
+			ring_page(i)->r_sleeping = 1;
+	for (i = 0; i < NRING; i++)
+		ring_serve(i);
+}
+
+// The server is awake: no doorbells are needed.
+static void
+serve_rings_wake(void)
+{
+	int i;
+
+	for (i = 0; i < NRING; i++)
+		if (ring_whom[i])
+			ring_page(i)->r_sleeping = 0;
+}
+
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
+	int perm, r, wait, w;
 	void *pg;
 
 	while (1) {
+		serve_rings();
+		journal_poll();
+		// The server has no timer of its own, so with files closed
+		// lately still to flush, or requests still to commit, it waits
+		// for the next request only until they are due.  A client
+		// already queued means no wait at all.
+		wait = -1;
+		if (!thisenv->env_ipc_nsenders) {
+			wait = fs_flush_delay();
+			if ((w = journal_delay()) >= 0 && (wait < 0 || w < wait))
+				wait = w;
+		}
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm, 0);
+		if (wait < 0)
+			req = ipc_recv((int32_t *) &whom, fsreq, &perm, 0);
+		else
+			req = ipc_recv_timeout((int32_t *) &whom, fsreq, &perm,
+					       0, MAX(wait, 1));
+		serve_rings_wake();
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
+		// A disk interrupt, and a background read may have finished,
+		// or the wait timed out and a flush or commit is due
+		if (whom == 0) {
+			bc_async_finish(false);
+			serve_pending();
+			fs_compact(COMPACT_SLICE);
+			fs_gc(GC_SLICE);
+			fs_flush_pending(false);
+			journal_poll();
+			continue;
+		}
+
+		// Queued requests are answered at the top of the loop
+		if (req == FSREQ_DOORBELL) {
+			fs_stats.st_ring_doorbells++;
+			continue;
+		}
+
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
@@ -364,17 +898,17 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
+		if (!serve_ready(whom, req, fsreq) && pending_add(whom, req) == 0) {
+			sys_page_unmap(0, fsreq);
+			continue;
 		}
+		r = serve_request(whom, req, fsreq, &pg, &perm);
 		ipc_send(whom, r, pg, perm);
 		sys_page_unmap(0, fsreq);
+		fs_compact(COMPACT_SLICE);
+		fs_gc(GC_SLICE);
+		fs_flush_pending(false);
+		journal_poll();
 	}
 }
 
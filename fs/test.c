@@ -43,25 +43,169 @@ fs_test(void)
 
 	*(volatile char*)blk = *(volatile char*)blk;
 	assert((uvpt[PGNUM(blk)] & PTE_D));
+	// Blocks the last commit uses reach the disk with the next one
 	file_flush(f, 0);
+	journal_commit();
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
 	cprintf("file_flush is good\n");
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
+	journal_commit();
 	assert(f->f_direct[0] == 0);
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
+	journal_commit();
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
 	assert((uvpt[PGNUM(blk)] & PTE_D));
 	file_flush(f, 0);
+	journal_commit();
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file rewrite is good\n");
 }
+
+// The allocator alloc_block used before the free-space summary: scan
+// the bitmap one block at a time from block 0.  Kept here only as the
+// baseline for fs_bench_alloc.
+static int
+alloc_block_linear(void)
+{
+    uint32_t blockno;
+    for (blockno = 0; blockno < super->s_nblocks; blockno++)
+        if (block_is_free(blockno)) {
+            bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+            return blockno;
+        }
+    return -E_NO_DISK;
+}
+
+// Fill the low 90% of the disk and compare the cycles per allocation
+// of the linear bitmap scan, which must then get past all of it, against
+// the summary-based claim_free_block.  The bitmap is restored before
+// returning.  Run with "fsbench alloc".
+void
+fs_bench_alloc(void)
+{
+    uint32_t nwords = (super->s_nblocks + 31) / 32;
+    uint32_t npages = ROUNDUP(nwords * 4, PGSIZE) / PGSIZE;
+    uint32_t *bits = (uint32_t*) UTEMP;
+    uint32_t b;
+    uint32_t blocks[64];
+    uint64_t start, linear = 0, summary = 0;
+    int i, n, r, round, nallocs = 0;
+
+    // back up bitmap
+    for (i = 0; i < npages; i++)
+        if ((r = sys_page_alloc(0, (char*) bits + i * PGSIZE,
+                        PTE_P|PTE_U|PTE_W)) < 0)
+            panic("sys_page_alloc: %e", r);
+    memmove(bits, bitmap, nwords * 4);
+
+    // leave only the top 10% of the disk free
+    for (b = 0; b < super->s_nblocks / 10 * 9; b++)
+        if (block_is_free(b))
+            mark_block_used(b);
+
+    for (round = 0; round < 100; round++) {
+        n = MIN(bitmap_free_count(), sizeof(blocks) / sizeof(blocks[0]));
+
+        start = read_tsc();
+        for (i = 0; i < n; i++)
+            blocks[i] = alloc_block_linear();
+        linear += read_tsc() - start;
+        for (i = 0; i < n; i++)
+            bitmap[blocks[i] / 32] |= 1 << (blocks[i] % 32);
+
+        start = read_tsc();
+        for (i = 0; i < n; i++)
+            blocks[i] = claim_free_block();
+        summary += read_tsc() - start;
+        for (i = 0; i < n; i++)
+            free_block(blocks[i]);
+
+        nallocs += n;
+    }
+
+    cprintf("alloc_block at 90%% full, %d allocations: "
+            "linear %lld cycles/alloc, summary %lld cycles/alloc\n",
+            nallocs, linear / nallocs, summary / nallocs);
+
+    // restore bitmap
+    memmove(bitmap, bits, nwords * 4);
+    bitmap_rebuild();
+    for (i = 0; i < npages; i++) {
+        flush_block((char*) bitmap + i * PGSIZE);
+        sys_page_unmap(0, (char*) bits + i * PGSIZE);
+    }
+}
+
+// Make one-byte edits to a 16-block file, flushing a new version after
+// each, with and without delta blocks.  Reports the disk blocks used
+// per edit, the cycles per edit and flush, and the cycles to read every
+// block of every old version back.  The files live in a scratch
+// directory, so that their versions stay out of the root's history,
+// and are removed with it afterwards.  Run with "fsbench delta".
+void
+fs_bench_delta(void)
+{
+    enum { NBLK = 16, NEDIT = 64 };
+    static char buf[BLKSIZE];
+    struct File *f, *v;
+    uint64_t start, edit, read;
+    uint32_t nfree;
+    char path[MAXPATHLEN];
+    bool enabled = delta_enabled;
+    int mode, i, r, nread;
+
+    if ((r = file_create("/bench-delta", 1, &f)) < 0)
+        panic("file_create /bench-delta: %e", r);
+
+    for (mode = 0; mode < 2; mode++) {
+        delta_enabled = mode;
+        snprintf(path, sizeof(path), "/bench-delta/%d", mode);
+        if ((r = file_create(path, 0, &f)) < 0)
+            panic("file_create %s: %e", path, r);
+        memset(buf, 'a', sizeof(buf));
+        for (i = 0; i < NBLK; i++)
+            if ((r = file_write(f, buf, BLKSIZE, i * BLKSIZE)) < 0)
+                panic("file_write: %e", r);
+        file_flush(f, sys_time_msec());
+
+        nfree = bitmap_free_count();
+        start = read_tsc();
+        for (i = 0; i < NEDIT; i++) {
+            if ((r = file_write(f, "b", 1,
+                            (i % NBLK) * BLKSIZE + i)) < 0)
+                panic("file_write: %e", r);
+            file_flush(f, sys_time_msec());
+        }
+        edit = read_tsc() - start;
+
+        nread = 0;
+        start = read_tsc();
+        for (v = f->f_next_file; v; v = v->f_next_file)
+            for (i = 0; i < NBLK; i++, nread++)
+                if ((r = file_read(v, buf, BLKSIZE, i * BLKSIZE)) < 0)
+                    panic("file_read: %e", r);
+        read = read_tsc() - start;
+
+        cprintf("%s copies, %d one-byte edits: %d blocks used, "
+                "%lld cycles/edit, %lld cycles/old block read\n",
+                mode ? "delta" : "full", NEDIT,
+                nfree - bitmap_free_count(),
+                edit / NEDIT, read / nread);
+        if ((r = file_remove(path)) < 0)
+            panic("file_remove %s: %e", path, r);
+    }
+    delta_enabled = enabled;
+
+    if ((r = file_remove("/bench-delta")) < 0)
+        panic("file_remove /bench-delta: %e", r);
+}
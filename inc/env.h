@@ -30,6 +30,10 @@ typedef int32_t envid_t;
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// As the environment to receive from, ENVID_IRQ makes sys_ipc_recv
+// accept only the IRQs the kernel forwards (see sys_irq_listen).
+#define ENVID_IRQ		(-1)
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -70,6 +74,19 @@ struct Env {
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
     envid_t env_ipc_srcenv;     // desired env to receive from (0 if any)
+    uint32_t env_ipc_timeout;   // time a receive gives up at, 0 if never
+    uint16_t env_irq_pending;   // IRQs raised but not yet received
+
+    // Blocking sends (see sys_ipc_send).  The queue is the kernel's;
+    // an environment reads only env_ipc_nsenders to see if it is busy.
+    uint32_t env_ipc_nsenders;  // envs blocked sending to us
+    struct Env *env_ipc_senders;    // envs blocked sending to us, oldest first
+    struct Env *env_ipc_sendnext;   // next env in the queue we are in
+    envid_t env_ipc_sendto;     // env we are blocked sending to, or 0
+    uint32_t env_ipc_sendval;   // what we are sending it
+    void *env_ipc_sendva;
+    unsigned env_ipc_sendperm;
+    bool env_ipc_calling;       // the send is a sys_ipc_call awaiting reply
 };
 
 #endif // !JOS_INC_ENV_H
@@ -26,6 +26,8 @@ struct Dev {
 
 struct FdFile {
 	int id;
+	envid_t buf_env;	// environment that gave the server a buffer
+	char *buf_va;		// where that buffer is mapped in it
 };
 
 struct FdSock {
@@ -52,6 +54,7 @@ struct Stat {
 };
 
 char*	fd2data(struct Fd *fd);
+char*	fd2buf(struct Fd *fd);
 int	fd2num(struct Fd *fd);
 int	fd_alloc(struct Fd **fd_store);
 int	fd_close(struct Fd *fd, bool must_exist);
@@ -23,8 +23,14 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of block pointers under the double-indirect block
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
+// Number of block pointers in all
+#define MAXFILEBLKS	(NDIRECT + NINDIRECT + NDINDIRECT)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// The double-indirect block maps more than a 32-bit off_t can reach,
+// so the limit is the last whole block below 2GB.
+#define MAXFILESIZE	0x7FFFF000
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
@@ -40,20 +46,100 @@ struct File {
     struct File *f_next_file;  // next version of file
     time_t f_timestamp;  // timestamp created
     bool f_dirty;  // modified from next version of file
+    uint32_t f_vindex;  // version index block, 0 if none yet
+
+    // Directory index
+    uint32_t f_dirhash;  // blocks in the name hash table, 0 if none
+    uint32_t f_dirfree;  // slots below this one are all in use
+    uint32_t f_dirdead;  // removed entries left in the hash table
+
+	// Taken from the padding, like the fields above, so that older
+	// disk images keep their layout
+	uint32_t f_dindirect;		// double-indirect block
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4 - sizeof(struct File*) - 8 - sizeof(bool)];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4 - sizeof(struct File*) - 8 - sizeof(bool) - 4 - 12 - 4];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
+// Version index (on-disk)
+//
+// Every version of a file shares one index, rooted at f_vindex.  The
+// root block holds the number of entries and the block numbers of the
+// entry blocks; the entries are (timestamp, version) pairs appended
+// oldest first, so a lookup by time is a binary search.
+struct VersionEntry {
+	time_t ve_timestamp;
+	struct File *ve_file;
+} __attribute__((packed));
+
+#define NVENTRIES	(BLKSIZE / sizeof(struct VersionEntry))
+#define NVBLOCKS	(BLKSIZE / 4 - 1)
+#define MAXVERSIONS	(NVBLOCKS * NVENTRIES)
+
+struct VersionIndex {
+	uint32_t vi_nentries;
+	uint32_t vi_blocks[NVBLOCKS];
+};
+
+// A block pointer of an old version of a regular file may name a delta
+// record instead of a disk block: the block is then rebuilt from the
+// same block of the next (older) version by applying the record.
+// Records are packed into pack blocks; the pointer holds the pack
+// block number and the record's slot in it.
+#define BLKPTR_DELTA		0x80000000
+#define BLKPTR_ISDELTA(p)	((p) & BLKPTR_DELTA)
+#define DELTA_PTR(pack, slot)	(BLKPTR_DELTA | ((pack) << 6) | (slot))
+#define DELTA_PACK(p)		(((p) & ~BLKPTR_DELTA) >> 6)
+#define DELTA_SLOT(p)		((p) & (NDELTASLOTS - 1))
+
+#define NDELTASLOTS	64
+
+// Header of a pack block; records follow it
+struct DeltaPack {
+	uint16_t dp_nrecs;		// slots in use
+	uint16_t dp_free;		// offset of the free space
+	uint16_t dp_nlive;		// records some version still uses
+	uint16_t dp_off[NDELTASLOTS];	// offset of each record
+};
+
+// A delta record is a header followed by ops, each of which replaces
+// do_len bytes at do_off in the base block with the bytes after it.
+// If dr_flags has DR_LZ, the header is instead followed by the whole
+// block compressed (see fs/lz.c), and there is no base.
+struct DeltaRec {
+	uint16_t dr_len;		// bytes in the record, header included
+	uint8_t dr_depth;		// deltas to apply to rebuild the block
+	uint8_t dr_flags;
+} __attribute__((packed));
+
+#define DR_LZ		0x01
+
+struct DeltaOp {
+	uint16_t do_off;
+	uint16_t do_len;
+} __attribute__((packed));
+
 // File types
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
 
+// Version retention policy.  A version at most rt_age seconds old (any
+// age if rt_age is 0) is judged by the first such rule: it is kept if
+// it is the newest version in its rt_interval-second period, or always
+// if rt_interval is 0.  Versions older than every rule are dropped.
+// With no rules every version is kept.
+#define NRETAIN		4
+
+struct Retention {
+	uint32_t rt_age;
+	uint32_t rt_interval;
+};
+
 // File system super-block (both in-memory and on-disk)
 
 #define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
@@ -62,8 +148,56 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_refmap;		// First block of the reference counts
+	uint32_t s_nrefmap;		// Blocks of reference counts, 0 if none
+	uint32_t s_fpmap;		// First block of the fingerprint table
+	uint32_t s_nfpmap;		// Blocks of fingerprints, 0 if none
+	uint32_t s_nretain;		// Rules in s_retain
+	struct Retention s_retain[NRETAIN];	// Versions to keep
+	uint32_t s_journal;		// First block of the journal
+	uint32_t s_njournal;		// Blocks of journal, 0 if none
+};
+
+// Write-ahead journal (on-disk).  A header block followed by the images
+// of the blocks of the last transaction committed.  A header whose
+// checksum matches the images describes a transaction that may not have
+// reached its home blocks yet; fs_init copies them there.
+#define JOURNAL_MAGIC	0x4A524E4C	// 'JRNL'
+#define NJOURNAL	64		// blocks fsformat reserves, header included
+#define JH_MAXBLKS	(BLKSIZE / 4 - 4)
+
+struct JournalHeader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC, or 0 if nothing to replay
+	uint32_t jh_seq;		// commits before this one
+	uint32_t jh_nblocks;		// images in the transaction
+	uint32_t jh_checksum;		// over the block numbers and images
+	uint32_t jh_blocknos[JH_MAXBLKS];	// home block of each image
 };
 
+// Blocks with identical contents may be shared between files.  The
+// reference count table has a 16-bit entry per block: the number of
+// references beyond the first, plus REF_FP if the block is in the
+// fingerprint table.  The fingerprint table maps a hash of a block's
+// contents to the block; an entry is looked for in a window of
+// FP_WINDOW slots starting at the hash.
+#define BLKREFS		(BLKSIZE / sizeof(uint16_t))
+#define REF_FP		0x8000
+#define REF_COUNT	0x7FFF
+
+struct FpEntry {
+	uint32_t fe_fp;			// fingerprint of the block's contents
+	uint32_t fe_blockno;		// block, or 0 if the slot is free
+};
+
+#define BLKFPS		(BLKSIZE / sizeof(struct FpEntry))
+#define FP_WINDOW	8
+
+// A client may hand the file system a buffer of FSBUFPAGES pages for a
+// file it has open, with one FSREQ_BUFFER request per page, and then
+// read and write up to FSBUFSIZE bytes at a time through it.
+#define FSBUFPAGES	16
+#define FSBUFSIZE	(FSBUFPAGES * PGSIZE)
+
 // Definitions for requests from clients to file system
 enum {
 	FSREQ_OPEN = 1,
@@ -77,7 +211,114 @@ enum {
 	FSREQ_HISTORY,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Stats returns a Fsret_stats on the request page
+	FSREQ_STATS,
+	// Retain returns the policy in force in its Fsreq_retain
+	FSREQ_RETAIN,
+	FSREQ_REVERT,
+	// Map read takes a Fsreq_read, and returns a page of the file
+	// mapped read-only, or else a Fsret_read like read
+	FSREQ_MAP_READ,
+	// Buffer's request page is the buffer page it hands over
+	FSREQ_BUFFER,
+	// Buffer read takes a Fsreq_read and returns the data in the buffer
+	FSREQ_BUF_READ,
+	FSREQ_BUF_WRITE,
+	// Ring's request page is the client's FsRing
+	FSREQ_RING,
+	// Doorbell has no page and gets no reply
+	FSREQ_DOORBELL,
+	// Bench runs one of the server's benchmarks, which print their
+	// results on the console
+	FSREQ_BENCH
+};
+
+// Benchmarks FSREQ_BENCH runs (see fs/test.c)
+enum {
+	FSBENCH_ALLOC,
+	FSBENCH_DELTA
+};
+
+// A client may also hand the file system a page holding an FsRing and
+// queue requests in it instead of sending each one, and the server
+// answers them in batches.  Requests move data through the buffers of
+// the files (see FSBUFPAGES), so only FSREQ_BUF_READ, FSREQ_BUF_WRITE,
+// FSREQ_SET_SIZE and FSREQ_FLUSH can be queued.  The heads and tails
+// count entries forever; entry i is at i % FSRING_ENTRIES.  Each side
+// only advances the index it owns: the client the submission tail and
+// the completion head, the server the other two.
+//
+// The server sets r_sleeping before it waits for IPC and clears it
+// once it has one, so a client that queues a request and finds it set
+// sends FSREQ_DOORBELL.  A client waiting for a completion sets
+// r_cq_wait and waits for IPC; the server sends it a value of 0 once
+// it has added completions.  Either flag is taken back with xchg, so
+// that exactly one side acts on it.
+#define FSRING_ENTRIES	64
+
+struct FsSqe {
+	uint32_t sqe_op;	// request code
+	int sqe_fileid;
+	uint32_t sqe_n;		// bytes to move, or the size for set size
+	uint32_t sqe_bufoff;	// where in the file's buffer they start
+	uint32_t sqe_data;	// handed back in the completion
+};
+
+struct FsCqe {
+	uint32_t cqe_data;	// sqe_data of the request
+	int cqe_result;		// what its reply would have been
+};
+
+struct FsRing {
+	volatile uint32_t r_sq_head, r_sq_tail;
+	volatile uint32_t r_cq_head, r_cq_tail;
+	volatile uint32_t r_sleeping;	// server is waiting for IPC
+	volatile uint32_t r_cq_wait;	// client is waiting for completions
+	volatile struct FsSqe r_sq[FSRING_ENTRIES];
+	volatile struct FsCqe r_cq[FSRING_ENTRIES];
+};
+
+// File server statistics, as returned by FSREQ_STATS
+struct FsStats {
+	uint32_t st_dcache_hits;	// path components found in the name cache
+	uint32_t st_dcache_misses;	// path components looked up in a directory
+	uint32_t st_ra_blocks;		// blocks read ahead of sequential reads
+	uint32_t st_ra_hits;		// read-ahead blocks that were then read
+	uint32_t st_ra_waste;		// read-ahead blocks dropped unread
+	uint32_t st_bc_blocks;		// blocks in the block cache
+	uint32_t st_bc_budget;		// blocks the block cache may hold
+	uint32_t st_bc_evictions;	// blocks dropped to make room
+	uint32_t st_bc_writebacks;	// dirty blocks written back on eviction
+	uint32_t st_bc_writes;		// disk write commands
+	uint32_t st_bc_blocks_written;	// blocks written by those commands
+	uint32_t st_delta_blocks;	// old blocks stored as deltas
+	uint32_t st_delta_bytes;	// bytes of delta records stored
+	uint32_t st_delta_full;		// old blocks kept whole instead
+	uint32_t st_dedup_hits;		// written blocks found to exist already
+	uint32_t st_dedup_fps;		// blocks added to the fingerprint table
+	uint32_t st_lz_blocks;		// old blocks stored compressed
+	uint32_t st_lz_bytes;		// bytes of compressed records stored
+	uint32_t st_lz_full;		// old blocks that did not compress
+	uint32_t st_lz_reads;		// compressed blocks rebuilt
+	uint64_t st_lz_read_cycles;	// cycles spent rebuilding them
+	uint32_t st_gc_versions;	// old versions dropped by the policy
+	uint32_t st_gc_blocks;		// blocks and records freed with them
+	uint32_t st_bc_reads;		// disk read commands
+	uint32_t st_bc_blocks_read;	// blocks read by those commands
+	uint32_t st_alloc_near;		// blocks placed right after the one before
+	uint32_t st_journal_commits;	// transactions written to the journal
+	uint32_t st_journal_txns;	// requests those commits covered
+	uint32_t st_journal_blocks;	// blocks written to the journal
+	uint32_t st_journal_overflows;	// commits too big for the journal
+	uint32_t st_journal_replays;	// transactions replayed at mount
+	uint32_t st_revert_blocks;	// blocks reverts shared instead of copying
+	uint32_t st_map_reads;		// blocks read by mapping the cached page
+	uint32_t st_buf_reads;		// reads through a client's buffer
+	uint32_t st_buf_writes;		// writes through a client's buffer
+	uint32_t st_ring_requests;	// requests answered from rings
+	uint32_t st_ring_batches;	// times rings had requests to answer
+	uint32_t st_ring_doorbells;	// doorbells rung
 };
 
 union Fsipc {
@@ -124,6 +365,27 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsret_stats {
+		struct FsStats ret_stats;
+	} statsRet;
+	struct Fsreq_retain {
+		int req_nrules;		// rules to set, or < 0 to leave them
+		struct Retention req_rules[NRETAIN];
+	} retain;
+	struct Fsreq_revert {
+		char req_path[MAXPATHLEN];	// "path@time" of the version
+	} revert;
+	struct Fsreq_buffer {
+		int req_fileid;
+		int req_page;		// 0 starts the buffer over
+	} buffer;
+	struct Fsreq_buf_write {
+		int req_fileid;
+		size_t req_n;		// bytes at the start of the buffer
+	} buf_write;
+	struct Fsreq_bench {
+		int req_which;		// one of FSBENCH_*
+	} bench;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -60,12 +60,17 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_chdir(const char *path);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg, envid_t srcenv);
+int	sys_ipc_recv_timeout(void *rcv_pg, envid_t srcenv, unsigned msec);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
 unsigned int sys_time_msec(void);
 int sys_net_transmit(void *va, uint32_t len);
 int sys_net_receive(void *va);
 int sys_mac_addr_low();
 int sys_mac_addr_high();
+int sys_ide_bm_base();
+int sys_irq_listen(int irq);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -83,6 +88,9 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store, envid_t srcenv);
+int32_t ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+			 envid_t srcenv, unsigned msec);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
@@ -108,7 +116,15 @@ int	open(const char *path, int mode);
 int	time_open(const char *path, const time_t timestamp, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
+int	fsrevert(const char *path);
 int	sync(void);
+int	fsstats(struct FsStats *st);
+int	fsbenchmark(int which);
+int	fsretain(struct Retention *rules, int n);
+char *	fsbuffer(int fdnum);
+int	fsring_init(void);
+int	fsring_submit(int fdnum, int op, size_t n, size_t bufoff, uint32_t data);
+int	fsring_reap(int *result, uint32_t *data, bool wait);
 
 // pageref.c
 int	pageref(void *addr);
@@ -161,5 +177,6 @@ void	wait(envid_t env);
 #define	O_TRUNC		0x0200		/* truncate to zero length */
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
+#define O_SYNC		0x1000		/* close makes the new version durable */
 
 #endif	// !JOS_INC_LIB_H
@@ -24,6 +24,10 @@ enum {
 	SYS_net_receive,
 	SYS_mac_addr_low,
 	SYS_mac_addr_high,
+	SYS_ide_bm_base,
+	SYS_irq_listen,
+	SYS_ipc_send,
+	SYS_ipc_call,
 	NSYSCALLS
 };
 
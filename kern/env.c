@@ -14,6 +14,7 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/syscall.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -246,6 +247,11 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_irq_pending = 0;
+	e->env_ipc_senders = NULL;
+	e->env_ipc_nsenders = 0;
+	e->env_ipc_sendto = 0;
+	e->env_ipc_calling = false;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -367,6 +373,9 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Take it out of any IPC send queues
+	ipc_cancel(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
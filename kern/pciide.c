@@ -0,0 +1,26 @@
+#include <inc/error.h>
+
+#include <kern/pciide.h>
+
+// I/O base of the bus-master registers, or 0 if there is no controller
+static uint32_t pciide_bm;
+
+// Initialize the IDE controller
+int
+pciide_attachfn(struct pci_func *pcif) {
+    // Enable I/O decoding and bus mastering
+    pci_func_enable(pcif);
+
+    if (pcif->reg_size[PCIIDE_BAR_BM] == 0)
+        return 0;
+    pciide_bm = pcif->reg_base[PCIIDE_BAR_BM];
+    return 1;
+}
+
+// Return the I/O base of the bus-master registers
+int
+pciide_bm_base() {
+    if (!pciide_bm)
+        return -E_NOT_FOUND;
+    return pciide_bm;
+}
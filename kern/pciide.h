@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_PCIIDE_H
+#define JOS_KERN_PCIIDE_H
+
+#include <kern/pci.h>
+
+// PCI IDE controllers (such as the PIIX that QEMU emulates) expose their
+// bus-master DMA registers as an I/O region in BAR 4.
+#define PCIIDE_BAR_BM	4
+
+int
+pciide_attachfn(struct pci_func *pcif);
+
+int
+pciide_bm_base();
+
+#endif	// JOS_KERN_PCIIDE_H
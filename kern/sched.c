@@ -58,6 +58,10 @@ sched_halt(void)
 		     envs[i].env_status == ENV_RUNNING ||
 		     envs[i].env_status == ENV_DYING))
 			break;
+		// A receive with a timeout will be woken by the timer
+		if (envs[i].env_status == ENV_NOT_RUNNABLE &&
+		    envs[i].env_ipc_recving && envs[i].env_ipc_timeout)
+			break;
 	}
 	if (i == NENV) {
 		cprintf("No runnable environments in the system!\n");
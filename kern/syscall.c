@@ -13,6 +13,7 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/pciide.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -288,6 +289,91 @@ sys_chdir(const char *path)
     return 0;
 }
 
+// Is dst blocked receiving, and willing to receive from src?
+static bool
+ipc_receiving_from(struct Env *dst, struct Env *src)
+{
+    return dst->env_ipc_recving &&
+        (!dst->env_ipc_srcenv || dst->env_ipc_srcenv == src->env_id);
+}
+
+// Check that curenv may send the page at srcva with perm, if srcva is
+// below UTOP.  Returns 0 if so, or -E_INVAL.
+static int
+ipc_check_page(void *srcva, unsigned perm)
+{
+    if (srcva >= (void*) UTOP)
+        return 0;
+    if (ROUNDDOWN(srcva, PGSIZE) != srcva)
+        return -E_INVAL;
+    if ((perm ^ (PTE_U | PTE_P)) & ~(PTE_AVAIL | PTE_W))
+        return -E_INVAL;
+
+    int checkPerm = PTE_U | PTE_P;
+    if (perm & PTE_W)
+        checkPerm |= PTE_W;
+    if (user_mem_check(curenv, srcva, PGSIZE, checkPerm) < 0)
+        return -E_INVAL;
+    return 0;
+}
+
+// Hand dst, which is receiving, the message value from src, mapping the
+// page at srcva in src if srcva is below UTOP and dst wants a page.
+// Leaves dst to be made runnable.  Returns 0 on success, -E_INVAL if
+// the page is gone, or -E_NO_MEM.
+static int
+ipc_deliver(struct Env *dst, struct Env *src, uint32_t value, void *srcva,
+            unsigned perm)
+{
+    bool pageTransferred = false;
+    if (srcva < (void*) UTOP && dst->env_ipc_dstva < (void*) UTOP) {
+        struct PageInfo *srcpage = page_lookup(src->env_pgdir, srcva, 0);
+        if (!srcpage)
+            return -E_INVAL;
+        if (page_insert(dst->env_pgdir, srcpage, dst->env_ipc_dstva, perm) < 0)
+            return -E_NO_MEM;
+        pageTransferred = true;
+    }
+
+    dst->env_ipc_recving = false;
+    dst->env_ipc_calling = false;
+    dst->env_ipc_from = src->env_id;
+    dst->env_ipc_value = value;
+    dst->env_ipc_perm = pageTransferred ? perm : 0;
+    dst->env_tf.tf_regs.reg_eax = 0;  // return 0 in dst
+    return 0;
+}
+
+// Unblock e, which was sending or calling, returning r from the system
+// call.
+static void
+ipc_wake(struct Env *e, int r)
+{
+    e->env_ipc_recving = false;
+    e->env_ipc_calling = false;
+    e->env_tf.tf_regs.reg_eax = r;
+    e->env_status = ENV_RUNNABLE;
+}
+
+// Block curenv sending value, and the page at srcva with perm, to dst,
+// at the end of dst's queue of senders.
+static void
+ipc_enqueue(struct Env *dst, uint32_t value, void *srcva, unsigned perm)
+{
+    struct Env **pp;
+
+    curenv->env_ipc_sendto = dst->env_id;
+    curenv->env_ipc_sendval = value;
+    curenv->env_ipc_sendva = srcva;
+    curenv->env_ipc_sendperm = perm;
+    curenv->env_ipc_sendnext = NULL;
+    for (pp = &dst->env_ipc_senders; *pp; pp = &(*pp)->env_ipc_sendnext)
+        /* find the tail */;
+    *pp = curenv;
+    dst->env_ipc_nsenders++;
+    curenv->env_status = ENV_NOT_RUNNABLE;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -330,44 +416,159 @@ static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
     struct Env *dstenv;
+    int r;
+
     if (envid2env(envid, &dstenv, 0) < 0)
         return -E_BAD_ENV;
-    if (!dstenv->env_ipc_recving)
-        return -E_IPC_NOT_RECV;
-    if (dstenv->env_ipc_srcenv && dstenv->env_ipc_srcenv != curenv->env_id)
+    if (!ipc_receiving_from(dstenv, curenv))
         return -E_IPC_NOT_RECV;
+    if ((r = ipc_check_page(srcva, perm)) < 0 ||
+            (r = ipc_deliver(dstenv, curenv, value, srcva, perm)) < 0)
+        return r;
+    dstenv->env_status = ENV_RUNNABLE;
+    return 0;
+}
 
-    bool pageTransferred = false;
-    if (srcva < (void*) UTOP) {
-        if (ROUNDDOWN(srcva, PGSIZE) != srcva)
-            return -E_INVAL;
-        if ((perm ^ (PTE_U | PTE_P)) & ~(PTE_AVAIL | PTE_W))
-            return -E_INVAL;
+// Like sys_ipc_try_send, but if envid is not receiving from us, block
+// until it is instead of failing.  Blocked senders wait in a queue on
+// the receiver, and sys_ipc_recv takes them oldest first.  Besides the
+// errors of sys_ipc_try_send, returns -E_BAD_ENV if envid exits before
+// taking the message, and -E_INVAL if envid is the caller.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+    struct Env *dstenv;
+    bool reply;
+    int r;
 
-        int checkPerm = PTE_U | PTE_P;
-        if (perm & PTE_W)
-            checkPerm |= PTE_W;
-        if (user_mem_check(curenv, srcva, PGSIZE, checkPerm) < 0)
-            return -E_INVAL;
+    if (envid2env(envid, &dstenv, 0) < 0)
+        return -E_BAD_ENV;
+    if ((r = ipc_check_page(srcva, perm)) < 0)
+        return r;
+    if (ipc_receiving_from(dstenv, curenv)) {
+        reply = dstenv->env_ipc_calling;
+        if ((r = ipc_deliver(dstenv, curenv, value, srcva, perm)) < 0)
+            return r;
+        dstenv->env_status = ENV_RUNNABLE;
+        // A reply to sys_ipc_call goes straight back to the caller,
+        // which has been waiting on us
+        if (reply) {
+            curenv->env_tf.tf_regs.reg_eax = 0;
+            env_run(dstenv);
+        }
+        return 0;
+    }
+    if (dstenv == curenv)
+        return -E_INVAL;
 
-        if (dstenv->env_ipc_dstva < (void*) UTOP) {
-            struct PageInfo *srcpage = page_lookup(
-                    curenv->env_pgdir, srcva, 0);
-            if (page_insert(dstenv->env_pgdir, srcpage,
-                    dstenv->env_ipc_dstva, perm) < 0) {
-                return -E_NO_MEM;
+    ipc_enqueue(dstenv, value, srcva, perm);
+    sched_yield();
+}
+
+// Send like sys_ipc_send, then wait for the reply from envid as
+// sys_ipc_recv(dstva, envid) would, all in one system call.  If envid
+// is receiving, it runs next, without a pass through the scheduler;
+// its reply with sys_ipc_send does the same for us.  Returns 0 with
+// the reply in env_ipc_* like sys_ipc_recv, or the errors of
+// sys_ipc_send and sys_ipc_recv.  -E_BAD_ENV also means envid exited
+// before replying.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+             void *dstva)
+{
+    struct Env *dstenv;
+    int r;
+
+    if (envid2env(envid, &dstenv, 0) < 0)
+        return -E_BAD_ENV;
+    if (dstenv == curenv)
+        return -E_INVAL;
+    if (dstva < (void*) UTOP && ROUNDDOWN(dstva, PGSIZE) != dstva)
+        return -E_INVAL;
+    if ((r = ipc_check_page(srcva, perm)) < 0)
+        return r;
+
+    bool delivered = false;
+    if (ipc_receiving_from(dstenv, curenv)) {
+        if ((r = ipc_deliver(dstenv, curenv, value, srcva, perm)) < 0)
+            return r;
+        delivered = true;
+    }
+    // Not receiving the reply until the request is taken, so that
+    // nothing envid sends before then is mistaken for it
+    curenv->env_ipc_dstva = dstva;
+    curenv->env_ipc_recving = delivered;
+    curenv->env_ipc_srcenv = dstenv->env_id;
+    curenv->env_ipc_timeout = 0;
+    curenv->env_ipc_calling = true;
+    if (!delivered) {
+        ipc_enqueue(dstenv, value, srcva, perm);
+        sched_yield();
+    }
+    curenv->env_status = ENV_NOT_RUNNABLE;
+    env_run(dstenv);
+}
+
+// Take e, which is being freed, out of the IPC send queues: off the
+// queue of the environment it is sending to, and failing the sends
+// queued on it, and the calls waiting for its reply, with -E_BAD_ENV.
+void
+ipc_cancel(struct Env *e)
+{
+    struct Env *dstenv, *src, **pp;
+    int i;
+
+    if (e->env_ipc_sendto && envid2env(e->env_ipc_sendto, &dstenv, 0) == 0)
+        for (pp = &dstenv->env_ipc_senders; *pp; pp = &(*pp)->env_ipc_sendnext)
+            if (*pp == e) {
+                *pp = e->env_ipc_sendnext;
+                dstenv->env_ipc_nsenders--;
+                break;
             }
-            pageTransferred = true;
-        }
+    e->env_ipc_sendto = 0;
+
+    e->env_ipc_nsenders = 0;
+    while ((src = e->env_ipc_senders)) {
+        e->env_ipc_senders = src->env_ipc_sendnext;
+        src->env_ipc_sendto = 0;
+        ipc_wake(src, -E_BAD_ENV);
     }
+    for (i = 0; i < NENV; i++)
+        if (envs[i].env_status == ENV_NOT_RUNNABLE &&
+                envs[i].env_ipc_calling && envs[i].env_ipc_recving &&
+                envs[i].env_ipc_srcenv == e->env_id)
+            ipc_wake(&envs[i], -E_BAD_ENV);
+    e->env_ipc_recving = false;
+    e->env_ipc_calling = false;
+}
 
-    dstenv->env_ipc_recving = false;
-    dstenv->env_ipc_from = curenv->env_id;
-    dstenv->env_ipc_value = value;
-    dstenv->env_ipc_perm = pageTransferred ? perm : 0;
-    dstenv->env_status = ENV_RUNNABLE;
-    dstenv->env_tf.tf_regs.reg_eax = 0;  // return 0 in dstenv
-    return 0;
+// Earliest time a receive gives up at, or 0 if none does.  Receives
+// that end some other way leave it behind, which costs one idle scan.
+static uint32_t ipc_next_timeout;
+
+// Fail the receives whose time is up with -E_TIMEOUT.  Called on each
+// timer tick.
+void
+ipc_expire(void)
+{
+    uint32_t now = time_msec(), next = 0;
+    struct Env *e;
+
+    if (!ipc_next_timeout || now < ipc_next_timeout)
+        return;
+    for (e = envs; e < envs + NENV; e++) {
+        if (e->env_status != ENV_NOT_RUNNABLE || !e->env_ipc_recving ||
+                e->env_ipc_calling || !e->env_ipc_timeout)
+            continue;
+        if (e->env_ipc_timeout <= now) {
+            e->env_ipc_recving = false;
+            e->env_ipc_timeout = 0;
+            e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+            e->env_status = ENV_RUNNABLE;
+        } else if (!next || e->env_ipc_timeout < next)
+            next = e->env_ipc_timeout;
+    }
+    ipc_next_timeout = next;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -376,24 +577,63 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
-// If srcenv is nonzero, then you will only receive from that environment.
+// If srcenv is nonzero, then you will only receive from that environment,
+// or only forwarded IRQs if it is ENVID_IRQ.
+// If msec is nonzero, then you give up after about that many ms, with a
+// return value of -E_TIMEOUT (see ipc_expire).
 //
-// This function only returns on error, but the system call will eventually
-// return 0 on success.
+// This function returns 0 at once if a pending IRQ or a queued sender
+// completes the receive, and otherwise only returns on error, but the
+// system call will eventually return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
 static int
-sys_ipc_recv(void *dstva, envid_t srcenv)
+sys_ipc_recv(void *dstva, envid_t srcenv, unsigned msec)
 {
-    if (dstva < (void*) UTOP) {
-        if (ROUNDDOWN(dstva, PGSIZE) != dstva)
-            return -E_INVAL;
+    struct Env *src, **pp;
+    int r;
 
-        curenv->env_ipc_dstva = dstva;
-    }
+    if (dstva < (void*) UTOP && ROUNDDOWN(dstva, PGSIZE) != dstva)
+        return -E_INVAL;
+    // A dstva above UTOP must not leave an earlier one in effect, now
+    // that a queued sender's page may be mapped right here
+    curenv->env_ipc_dstva = dstva;
     curenv->env_ipc_recving = true;
-    curenv->env_status = ENV_NOT_RUNNABLE;
     curenv->env_ipc_srcenv = srcenv;
+    curenv->env_ipc_timeout = msec ? time_msec() + msec : 0;
+    if (msec && (!ipc_next_timeout ||
+                 curenv->env_ipc_timeout < ipc_next_timeout))
+        ipc_next_timeout = curenv->env_ipc_timeout;
+    // An IRQ that was raised since the last receive completes it at once
+    if ((!srcenv || srcenv == ENVID_IRQ) && curenv->env_irq_pending) {
+        irq_deliver(curenv);
+        return 0;
+    }
+
+    // So does the oldest sender blocked in sys_ipc_send that we accept.
+    // One whose page cannot be mapped gets the error instead.  One in
+    // sys_ipc_call goes on to wait for our reply.
+    pp = &curenv->env_ipc_senders;
+    while ((src = *pp)) {
+        if (srcenv && src->env_id != srcenv) {
+            pp = &src->env_ipc_sendnext;
+            continue;
+        }
+        *pp = src->env_ipc_sendnext;
+        curenv->env_ipc_nsenders--;
+        src->env_ipc_sendto = 0;
+        r = ipc_deliver(curenv, src, src->env_ipc_sendval,
+                        src->env_ipc_sendva, src->env_ipc_sendperm);
+        if (r == 0 && src->env_ipc_calling) {
+            src->env_ipc_recving = true;
+            return 0;
+        }
+        ipc_wake(src, r);
+        if (r == 0)
+            return 0;
+    }
+
+    curenv->env_status = ENV_NOT_RUNNABLE;
     sched_yield();
 }
 
@@ -447,6 +687,32 @@ sys_mac_addr_high()
     return e1000_mac_addr_high();
 }
 
+// Receive IRQ irq as IPC messages from envid 0 (see irq_listen).
+// Only environments with I/O privilege may take over device interrupts.
+// Errors are:
+//  -E_BAD_ENV if curenv does not have I/O privilege.
+//  -E_INVAL if irq is handled by the kernel.
+static int
+sys_irq_listen(int irq)
+{
+    if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+        return -E_BAD_ENV;
+    return irq_listen(curenv, irq);
+}
+
+// Return the I/O base of the IDE bus-master DMA registers.
+// Only environments with I/O privilege may use them.
+// Errors are:
+//  -E_BAD_ENV if curenv does not have I/O privilege.
+//  -E_NOT_FOUND if there is no bus-master IDE controller.
+static int
+sys_ide_bm_base()
+{
+    if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+        return -E_BAD_ENV;
+    return pciide_bm_base();
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -487,7 +753,8 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
             return sys_ipc_try_send((envid_t) a1, (uint32_t) a2,
                     (void*) a3, (unsigned) a4);
         case SYS_ipc_recv:
-            sys_ipc_recv((void*) a1, (envid_t) a2);  // does not return
+            // Returns at once if a sender or IRQ was waiting
+            return sys_ipc_recv((void*) a1, (envid_t) a2, (unsigned) a3);
         case SYS_time_msec:
             return sys_time_msec();
         case SYS_net_transmit:
@@ -498,6 +765,16 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
             return sys_mac_addr_low();
         case SYS_mac_addr_high:
             return sys_mac_addr_high();
+        case SYS_irq_listen:
+            return sys_irq_listen((int) a1);
+        case SYS_ide_bm_base:
+            return sys_ide_bm_base();
+        case SYS_ipc_send:
+            return sys_ipc_send((envid_t) a1, (uint32_t) a2,
+                    (void*) a3, (unsigned) a4);
+        case SYS_ipc_call:
+            return sys_ipc_call((envid_t) a1, (uint32_t) a2,
+                    (void*) a3, (unsigned) a4, (void*) a5);
         default:
             return -E_INVAL;
 	}
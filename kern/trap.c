@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -207,6 +208,55 @@ print_regs(struct PushRegs *regs)
 	cprintf("  eax  0x%08x\n", regs->reg_eax);
 }
 
+// Environment that receives each device IRQ, or 0 if the kernel does
+static envid_t irq_owner[MAX_IRQS];
+
+// Send IRQ irq to environment e from now on.  Each interrupt is
+// received by e as an IPC from envid 0 whose value is the IRQ number;
+// interrupts raised while e is not receiving are held until it is.
+// Only the disk IRQs are forwarded (see trap_dispatch).
+// Returns 0 on success, -E_INVAL if irq is not one of them.
+int
+irq_listen(struct Env *e, int irq)
+{
+    if (irq != IRQ_IDE && irq != IRQ_IDE2)
+        return -E_INVAL;
+
+    irq_owner[irq] = e->env_id;
+    irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+    return 0;
+}
+
+// Complete e's ipc_recv with its lowest pending IRQ.
+void
+irq_deliver(struct Env *e)
+{
+    int irq = __builtin_ctz(e->env_irq_pending);
+
+    e->env_irq_pending &= ~(1 << irq);
+    e->env_ipc_recving = false;
+    e->env_ipc_from = 0;
+    e->env_ipc_value = irq;
+    e->env_ipc_perm = 0;
+    e->env_tf.tf_regs.reg_eax = 0;
+}
+
+// Hand IRQ irq to the environment listening for it.
+static void
+irq_forward(int irq)
+{
+    struct Env *e;
+
+    if (!irq_owner[irq] || envid2env(irq_owner[irq], &e, 0) < 0)
+        return;
+    e->env_irq_pending |= 1 << irq;
+    if (e->env_ipc_recving &&
+        (!e->env_ipc_srcenv || e->env_ipc_srcenv == ENVID_IRQ)) {
+        irq_deliver(e);
+        e->env_status = ENV_RUNNABLE;
+    }
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -229,8 +279,10 @@ trap_dispatch(struct Trapframe *tf)
             break;
         case IRQ_OFFSET + IRQ_TIMER:
             // Handle clock interrupts.
-            if (cpunum() == 0)
+            if (cpunum() == 0) {
                 time_tick();
+                ipc_expire();
+            }
             lapic_eoi();
             sched_yield();
             break;
@@ -251,6 +303,12 @@ trap_dispatch(struct Trapframe *tf)
             cprintf("Spurious interrupt on irq 7\n");
             print_trapframe(tf);
             break;
+        case IRQ_OFFSET + IRQ_IDE:
+        case IRQ_OFFSET + IRQ_IDE2:
+            // Handle disk interrupts in the environment driving the disk.
+            lapic_eoi();
+            irq_forward(tf->tf_trapno - IRQ_OFFSET);
+            break;
         default:
             // Unexpected trap: The user process or the kernel has a bug.
             print_trapframe(tf);
@@ -9,6 +9,9 @@
 // Bottom of file data area.  We reserve one data page for each FD,
 // which devices can use if they choose.
 #define FILEDATA	(FDTABLE + MAXFD*PGSIZE)
+// Bottom of the file buffer area, with FSBUFSIZE bytes for each FD
+// that devfile may share with the file server.
+#define FILEBUF		(FILEDATA + MAXFD*PGSIZE)
 
 // Return the 'struct Fd*' for file descriptor index i
 #define INDEX2FD(i)	((struct Fd*) (FDTABLE + (i)*PGSIZE))
@@ -32,6 +35,12 @@ fd2data(struct Fd *fd)
 	return INDEX2DATA(fd2num(fd));
 }
 
+char*
+fd2buf(struct Fd *fd)
+{
+	return (char*) (FILEBUF + fd2num(fd) * FSBUFSIZE);
+}
+
 // Finds the smallest i from 0 to MAXFD-1 that doesn't have
 // its fd page mapped.
 // Sets *fd_store to the corresponding fd page virtual address.
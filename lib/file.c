@@ -1,3 +1,4 @@
+#include <inc/x86.h>
 #include <inc/fs.h>
 #include <inc/string.h>
 #include <inc/lib.h>
@@ -6,26 +7,44 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// The request ring, alone on its page
+static union {
+	struct FsRing ring;
+	char pad[PGSIZE];
+} fsringpg __attribute__((aligned(PGSIZE)));
+static envid_t fsring_env;	// environment that handed it over
+
+static envid_t
+fsipc_env(void)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+	return fsenv;
+}
+
 // Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
+// a reply.  The request body should be in the page pg, and parts of the
+// response may be written back to it.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc_page(unsigned type, void *pg, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)pg);
 
-	static_assert(sizeof(fsipcbuf) == PGSIZE);
+	return ipc_call(fsipc_env(), type, pg, PTE_P | PTE_W | PTE_U, dstva);
+}
 
-	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+// Send a request whose body is in fsipcbuf.
+static int
+fsipc(unsigned type, void *dstva)
+{
+	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL, 0);
+	return fsipc_page(type, &fsipcbuf, dstva);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -113,21 +132,87 @@ remove(const char *path)
     return 0;
 }
 
+// Make the old version "path@time" the current version of path.  The
+// server shares its blocks instead of copying them.
+int
+fsrevert(const char *path)
+{
+    if (strlen(path) >= MAXPATHLEN)
+        return -E_BAD_PATH;
+
+    strcpy(fsipcbuf.revert.req_path, path);
+    return fsipc(FSREQ_REVERT, NULL);
+}
+
 // Flush the file descriptor.  After this the fileid is invalid.
 //
 // This function is called by fd_close.  fd_close will take care of
 // unmapping the FD page from this environment.  Since the server uses
 // the reference counts on the FD pages to detect which files are
 // open, unmapping it is enough to free up server-side resources.
-// Other than that, we just have to make sure our changes are flushed
-// to disk.
+// Other than that, we just have to ask for our changes to become a new
+// version.  The server batches those, unless the file was opened with
+// O_SYNC, in which case the version is on disk when this returns.
 static int
 devfile_flush(struct Fd *fd)
 {
+	int i;
+
+	// Unless another fd or environment still shares the Fd page with
+	// us and the server, our buffer for it goes with it
+	if (fd->fd_file.buf_env == thisenv->env_id && pageref(fd) <= 2) {
+		for (i = 0; i < FSBUFPAGES; i++)
+			sys_page_unmap(0, fd->fd_file.buf_va + i * PGSIZE);
+		fd->fd_file.buf_env = 0;
+	}
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
 	return fsipc(FSREQ_FLUSH, NULL);
 }
 
+// Return fd's buffer, handing the server one first if a transfer of n
+// bytes makes it worth the FSBUFPAGES requests that takes, or NULL to
+// go a page at a time.  Only the environment that handed it over uses
+// a buffer.  Its pages are mapped PTE_SHARE so that forking does not
+// make them copy-on-write and cut them off from the server.
+static char *
+devfile_buffer(struct Fd *fd, size_t n)
+{
+	char *va;
+	int i, r;
+
+	if (fd->fd_file.buf_env == thisenv->env_id)
+		return fd->fd_file.buf_va;
+	// A file moved a page at a time past its first FSBUFSIZE bytes is
+	// likely to be a big one
+	if (fd->fd_file.buf_env || n <= PGSIZE ||
+	    (n < FSBUFSIZE && fd->fd_offset < FSBUFSIZE))
+		return NULL;
+
+	// The area may still be in use through a dup of an older fd
+	va = fd2buf(fd);
+	if (pageref(va))
+		return NULL;
+	for (i = 0; i < FSBUFPAGES; i++) {
+		if ((r = sys_page_alloc(0, va + i * PGSIZE,
+					PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+			goto fail;
+		// The page carries its own request
+		((union Fsipc *) (va + i * PGSIZE))->buffer.req_fileid =
+			fd->fd_file.id;
+		((union Fsipc *) (va + i * PGSIZE))->buffer.req_page = i;
+		if ((r = fsipc_page(FSREQ_BUFFER, va + i * PGSIZE, NULL)) < 0)
+			goto fail;
+	}
+	fd->fd_file.buf_env = thisenv->env_id;
+	fd->fd_file.buf_va = va;
+	return va;
+
+fail:
+	for (; i >= 0; i--)
+		sys_page_unmap(0, va + i * PGSIZE);
+	return NULL;
+}
+
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
 //
 // Returns:
@@ -142,8 +227,35 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	char *fsbuf;
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
+
+	// Reads of more than a page go through the buffer, if there is one
+	if ((fsbuf = devfile_buffer(fd, n)) != NULL) {
+		if ((r = fsipc(FSREQ_BUF_READ, NULL)) < 0)
+			return r;
+		assert(r <= n);
+		memmove(buf, fsbuf, r);
+		return r;
+	}
+
+	// A whole block can be read by mapping the server's cached copy of
+	// it, which it sends instead of copying it into fsipcbuf when the
+	// block can no longer change
+	if (fd->fd_offset % BLKSIZE == 0 && n >= BLKSIZE) {
+		if ((r = fsipc(FSREQ_MAP_READ, fd2data(fd))) < 0)
+			return r;
+		assert(r <= n);
+		if (thisenv->env_ipc_perm & PTE_P) {
+			memmove(buf, fd2data(fd), r);
+			sys_page_unmap(0, fd2data(fd));
+		} else
+			memmove(buf, fsipcbuf.readRet.ret_buf, r);
+		return r;
+	}
+
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
 		return r;
 	assert(r <= n);
@@ -162,6 +274,18 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 {
 	// Make an FSREQ_WRITE request to the file system server.
     int r;
+    char *fsbuf;
+
+    if ((fsbuf = devfile_buffer(fd, n)) != NULL) {
+        n = MIN(n, FSBUFSIZE);
+        memmove(fsbuf, buf, n);
+        fsipcbuf.buf_write.req_fileid = fd->fd_file.id;
+        fsipcbuf.buf_write.req_n = n;
+        if ((r = fsipc(FSREQ_BUF_WRITE, NULL)) < 0)
+            return r;
+        assert(r <= n);
+        return r;
+    }
 
     // Limit n to the size of the buffer.
     if (n > sizeof(fsipcbuf.write.req_buf))
@@ -224,3 +348,150 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Fetch the file server's statistics
+int
+fsstats(struct FsStats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet.ret_stats;
+	return 0;
+}
+
+// Have the file server run benchmark which, one of FSBENCH_*.  It
+// prints the results on the console.
+int
+fsbenchmark(int which)
+{
+	fsipcbuf.bench.req_which = which;
+	return fsipc(FSREQ_BENCH, NULL);
+}
+
+// Set the file server's version retention policy to the n rules in
+// rules, unless n < 0, then copy the policy in force back into rules,
+// which must have room for NRETAIN.  Returns the number of rules.
+int
+fsretain(struct Retention *rules, int n)
+{
+	int r;
+
+	if (n > NRETAIN)
+		return -E_INVAL;
+	fsipcbuf.retain.req_nrules = n;
+	if (n > 0)
+		memmove(fsipcbuf.retain.req_rules, rules, n * sizeof(*rules));
+	if ((r = fsipc(FSREQ_RETAIN, NULL)) < 0)
+		return r;
+	memmove(rules, fsipcbuf.retain.req_rules, NRETAIN * sizeof(*rules));
+	return fsipcbuf.retain.req_nrules;
+}
+
+
+// Return fdnum's buffer of FSBUFSIZE bytes, handing the file server
+// one first if need be, or NULL if fdnum cannot have one.  Requests
+// queued in the ring move data through it.
+char *
+fsbuffer(int fdnum)
+{
+	struct Fd *fd;
+
+	if (fd_lookup(fdnum, &fd) < 0 || fd->fd_dev_id != devfile.dev_id)
+		return NULL;
+	return devfile_buffer(fd, FSBUFSIZE);
+}
+
+// Hand the file server a request ring, if this environment has not
+// already.  Its page is mapped PTE_SHARE so that forking does not make
+// it copy-on-write; a child gets a page of its own when it asks.
+// Returns 0 on success, < 0 on error.
+int
+fsring_init(void)
+{
+	int r;
+
+	if (fsring_env == thisenv->env_id)
+		return 0;
+	if ((r = sys_page_alloc(0, &fsringpg,
+				PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		return r;
+	if ((r = fsipc_page(FSREQ_RING, &fsringpg, NULL)) < 0)
+		return r;
+	fsring_env = thisenv->env_id;
+	return 0;
+}
+
+// Queue request op (FSREQ_BUF_READ, FSREQ_BUF_WRITE, FSREQ_SET_SIZE or
+// FSREQ_FLUSH) on fdnum, moving n bytes through its buffer from byte
+// bufoff on, or setting its size to n.  Its completion carries data.
+// Returns 0 on success, -E_NO_MEM if the ring is full, or < 0 on
+// other errors.
+int
+fsring_submit(int fdnum, int op, size_t n, size_t bufoff, uint32_t data)
+{
+	struct FsRing *ring = &fsringpg.ring;
+	volatile struct FsSqe *sqe;
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fsring_env != thisenv->env_id || fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	if ((op == FSREQ_BUF_READ || op == FSREQ_BUF_WRITE) &&
+	    !devfile_buffer(fd, FSBUFSIZE))
+		return -E_INVAL;
+	if (ring->r_sq_tail - ring->r_sq_head == FSRING_ENTRIES)
+		return -E_NO_MEM;
+
+	sqe = &ring->r_sq[ring->r_sq_tail % FSRING_ENTRIES];
+	sqe->sqe_op = op;
+	sqe->sqe_fileid = fd->fd_file.id;
+	sqe->sqe_n = n;
+	sqe->sqe_bufoff = bufoff;
+	sqe->sqe_data = data;
+	ring->r_sq_tail++;
+	if (xchg(&ring->r_sleeping, 0))
+		ipc_send(fsipc_env(), FSREQ_DOORBELL, NULL, 0);
+	return 0;
+}
+
+// Take the oldest completion off the ring, setting *result to what its
+// request returned and *data to what it was queued with.  If there is
+// none, wait for one if wait is set.  Returns 1 if there was one, 0 if
+// not, or -E_INVAL if there is nothing to wait for.
+int
+fsring_reap(int *result, uint32_t *data, bool wait)
+{
+	struct FsRing *ring = &fsringpg.ring;
+	volatile struct FsCqe *cqe;
+
+	if (fsring_env != thisenv->env_id)
+		return -E_INVAL;
+	while (ring->r_cq_head == ring->r_cq_tail) {
+		if (!wait)
+			return 0;
+		// Ask to be told, then look again: the server may have
+		// answered meanwhile, or have nothing left to answer
+		ring->r_cq_wait = 1;
+		if (ring->r_cq_head == ring->r_cq_tail &&
+		    ring->r_sq_head != ring->r_sq_tail)
+			ipc_recv(NULL, NULL, NULL, fsipc_env());
+		else if (!xchg(&ring->r_cq_wait, 0))
+			// The server took it, and its message is on the way
+			ipc_recv(NULL, NULL, NULL, fsipc_env());
+		else if (ring->r_cq_head == ring->r_cq_tail)
+			return -E_INVAL;
+	}
+
+	cqe = &ring->r_cq[ring->r_cq_head % FSRING_ENTRIES];
+	*result = cqe->cqe_result;
+	if (data)
+		*data = cqe->cqe_data;
+	ring->r_cq_head++;
+	// The server stops when the completions fill up
+	if (ring->r_sq_head != ring->r_sq_tail && xchg(&ring->r_sleeping, 0))
+		ipc_send(fsipc_env(), FSREQ_DOORBELL, NULL, 0);
+	return 1;
+}
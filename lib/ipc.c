@@ -15,11 +15,20 @@
 // Otherwise, return the value sent by the sender
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store, envid_t srcenv)
+{
+    return ipc_recv_timeout(from_env_store, pg, perm_store, srcenv, 0);
+}
+
+// Like ipc_recv, but if 'msec' is nonzero, give up after about that many
+// ms and return -E_TIMEOUT.
+int32_t
+ipc_recv_timeout(envid_t *from_env_store, void *pg, int *perm_store,
+                 envid_t srcenv, unsigned msec)
 {
     if (pg == NULL)
         pg = (void*) UTOP;  // an invalid address
 
-    int result = sys_ipc_recv(pg, srcenv);
+    int result = sys_ipc_recv_timeout(pg, srcenv, msec);
     if (result < 0) {
         if (from_env_store)
             *from_env_store = 0;
@@ -36,23 +45,41 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store, envid_t srcenv)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until 'toenv' receives it, rather
+// than spinning on sys_ipc_try_send, so a busy receiver does not cost
+// its waiting senders any CPU.
+// It panics on any error.
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
     if (pg == NULL)
         pg = (void*) UTOP;  // an invalid address
 
-    int result;
-    while ((result = sys_ipc_try_send(to_env, val, pg, perm)) ==
-            -E_IPC_NOT_RECV) {
-        sys_yield();
-    }
+    int result = sys_ipc_send(to_env, val, pg, perm);
     if (result < 0)
         panic("ipc_send: %e\n", result);
 }
 
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// then wait for its reply, mapping any page it sends at 'rcv_pg' if
+// 'rcv_pg' is nonnull, and return the value it sent.  This is one
+// system call rather than ipc_send and ipc_recv's two, and the kernel
+// switches straight to 'to_env' and back.
+// It panics on any error.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm, void *rcv_pg)
+{
+    if (pg == NULL)
+        pg = (void*) UTOP;  // an invalid address
+    if (rcv_pg == NULL)
+        rcv_pg = (void*) UTOP;
+
+    int result = sys_ipc_call(to_env, val, pg, perm, rcv_pg);
+    if (result < 0)
+        panic("ipc_call: %e\n", result);
+    return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
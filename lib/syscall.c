@@ -123,12 +123,31 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva);
+}
+
 int
 sys_ipc_recv(void *dstva, envid_t srcenv)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, srcenv, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_timeout(void *dstva, envid_t srcenv, unsigned msec)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, srcenv, msec, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
@@ -158,3 +177,15 @@ sys_mac_addr_high()
 {
     return syscall(SYS_mac_addr_high, 0, 0, 0, 0, 0, 0);
 }
+
+int
+sys_irq_listen(int irq)
+{
+    return syscall(SYS_irq_listen, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_ide_bm_base()
+{
+    return syscall(SYS_ide_bm_base, 0, 0, 0, 0, 0, 0);
+}
@@ -1,16 +1,19 @@
 #include <inc/lib.h>
 
-char buf[63 * 64];
+// A buffer's worth at a time, so that the file server moves it all
+// with one request each way
+char buf[FSBUFSIZE];
 
 void
 cp(int f1, int f2, char *s1, char *s2)
 {
-	long n;
+	long n, m;
 	int r;
 
 	while ((n = read(f1, buf, (long) sizeof(buf))) > 0)
-		if ((r = write(f2, buf, n)) != n)
-			panic("error writing %s: %e", s2, r);
+		for (m = 0; m < n; m += r)
+			if ((r = write(f2, buf + m, n - m)) <= 0)
+				panic("error writing %s: %e", s2, r);
 	if (n < 0)
 		panic("error reading %s: %e", s1, n);
 }
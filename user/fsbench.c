@@ -0,0 +1,215 @@
+#include <inc/lib.h>
+
+// Usage: fsbench [nclients [nreqs]] | alloc | delta | ring
+//
+// Time nclients environments each making nreqs requests of the file
+// server at once, first with senders that spin on sys_ipc_try_send the
+// old way, then with ones that block in sys_ipc_send, then with ones
+// that send and wait for the reply in one sys_ipc_call.  Meanwhile a
+// spinner counts how much CPU is left over, and each client notes how
+// often it was run: spinning senders are run again and again to find
+// the server still busy.
+//
+// "fsbench ring" instead checks the request ring: it queues buffered
+// writes and reads of a file through it, and checks what comes back.
+
+#define MAXCLIENTS	64
+
+enum { SPIN, BLOCK, CALL };
+
+// Shared with the children, so that they can report back
+struct Bench {
+    volatile bool done;
+    volatile uint32_t spare;
+    volatile uint32_t runs[MAXCLIENTS];
+};
+
+static struct Bench *bench = (struct Bench *) 0xA0000000;
+
+// One request's page, as fsipc would send it
+static union Fsipc req __attribute__((aligned(PGSIZE)));
+
+static void
+client(int i, envid_t fsenv, int nreqs, int mode)
+{
+    int n, r;
+
+    for (n = 0; n < nreqs; n++) {
+        if (mode == CALL) {
+            ipc_call(fsenv, FSREQ_STATS, &req, PTE_P | PTE_W | PTE_U, &req);
+            continue;
+        }
+        if (mode == BLOCK)
+            ipc_send(fsenv, FSREQ_STATS, &req, PTE_P | PTE_W | PTE_U);
+        else {
+            while ((r = sys_ipc_try_send(fsenv, FSREQ_STATS, &req,
+                            PTE_P | PTE_W | PTE_U)) == -E_IPC_NOT_RECV)
+                sys_yield();
+            if (r < 0)
+                panic("sys_ipc_try_send: %e", r);
+        }
+        if ((r = ipc_recv(NULL, &req, NULL, fsenv)) < 0)
+            panic("ipc_recv: %e", r);
+    }
+    bench->runs[i] = thisenv->env_runs;
+}
+
+static void
+run(const char *name, int nclients, int nreqs, int mode)
+{
+    envid_t fsenv, spinner, clients[MAXCLIENTS];
+    unsigned start, end;
+    uint32_t runs = 0;
+    int i;
+
+    fsenv = ipc_find_env(ENV_TYPE_FS);
+    memset((void *) bench, 0, sizeof(*bench));
+
+    if ((spinner = fork()) < 0)
+        panic("fork: %e", spinner);
+    if (spinner == 0) {
+        while (!bench->done)
+            bench->spare++;
+        exit();
+    }
+
+    start = sys_time_msec();
+    for (i = 0; i < nclients; i++) {
+        if ((clients[i] = fork()) < 0)
+            panic("fork: %e", clients[i]);
+        if (clients[i] == 0) {
+            client(i, fsenv, nreqs, mode);
+            exit();
+        }
+    }
+    for (i = 0; i < nclients; i++)
+        wait(clients[i]);
+    end = sys_time_msec();
+    bench->done = true;
+    wait(spinner);
+
+    for (i = 0; i < nclients; i++)
+        runs += bench->runs[i];
+    printf("%s: %u ms, %u client runs, %u spare loops\n",
+           name, end - start, runs, bench->spare);
+}
+
+#define RINGFILE	"/fsbench-ring"
+#define RINGROUNDS	8
+
+// Wait for the next completion, which must be for the request queued
+// with data and have returned result.
+static void
+ring_expect(uint32_t data, int result)
+{
+    uint32_t got;
+    int r, res;
+
+    if ((r = fsring_reap(&res, &got, true)) != 1)
+        panic("fsring_reap: %e", r);
+    if (got != data || res != result)
+        panic("completion %u returned %d, expected %u returning %d",
+              got, res, data, result);
+}
+
+// Write the file one buffer page per request, read it back the same
+// way, and check the data, several times over so that the ring wraps.
+static void
+ring(void)
+{
+    int fd, i, j, r, res, round;
+    uint32_t data = 0;
+    struct Stat st;
+    char *buf;
+
+    if ((r = fsring_init()) < 0)
+        panic("fsring_init: %e", r);
+    if ((fd = open(RINGFILE, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+        panic("open %s: %e", RINGFILE, fd);
+    if ((buf = fsbuffer(fd)) == NULL)
+        panic("fsbuffer: no buffer");
+
+    for (round = 0; round < RINGROUNDS; round++) {
+        seek(fd, 0);
+        for (i = 0; i < FSBUFPAGES; i++)
+            memset(buf + i * PGSIZE, round * FSBUFPAGES + i, PGSIZE);
+        for (i = 0; i < FSBUFPAGES; i++)
+            if ((r = fsring_submit(fd, FSREQ_BUF_WRITE, PGSIZE,
+                                   i * PGSIZE, data + i)) < 0)
+                panic("fsring_submit: %e", r);
+        if ((r = fsring_submit(fd, FSREQ_FLUSH, 0, 0,
+                               data + FSBUFPAGES)) < 0)
+            panic("fsring_submit: %e", r);
+        for (i = 0; i < FSBUFPAGES; i++)
+            ring_expect(data + i, PGSIZE);
+        ring_expect(data + FSBUFPAGES, 0);
+        data += FSBUFPAGES + 1;
+
+        // Read the pages back in the opposite order of the buffer
+        seek(fd, 0);
+        memset(buf, 0, FSBUFSIZE);
+        for (i = FSBUFPAGES - 1; i >= 0; i--)
+            if ((r = fsring_submit(fd, FSREQ_BUF_READ, PGSIZE,
+                                   i * PGSIZE, data + i)) < 0)
+                panic("fsring_submit: %e", r);
+        for (i = FSBUFPAGES - 1; i >= 0; i--)
+            ring_expect(data + i, PGSIZE);
+        data += FSBUFPAGES;
+        for (i = 0; i < FSBUFPAGES; i++)
+            for (j = 0; j < PGSIZE; j++)
+                if (buf[i * PGSIZE + j] !=
+                    (char) (round * FSBUFPAGES + FSBUFPAGES - 1 - i))
+                    panic("round %d: byte %d of page %d is %02x",
+                          round, j, i, (unsigned char) buf[i * PGSIZE + j]);
+    }
+
+    if ((r = fsring_submit(fd, FSREQ_SET_SIZE, 0, 0, data)) < 0)
+        panic("fsring_submit: %e", r);
+    ring_expect(data++, 0);
+    if ((r = fstat(fd, &st)) < 0)
+        panic("fstat: %e", r);
+    if (st.st_size != 0)
+        panic("set size left %d bytes", st.st_size);
+    if (fsring_reap(&res, NULL, false) != 0)
+        panic("fsring_reap: completion left over");
+
+    close(fd);
+    if ((r = remove(RINGFILE)) < 0)
+        panic("remove %s: %e", RINGFILE, r);
+    printf("ring: %u requests ok\n", data);
+}
+
+void
+umain(int argc, char **argv)
+{
+    int r, nclients = 8, nreqs = 200;
+
+    binaryname = "fsbench";
+    // The file server's own benchmarks print on the console
+    if (argc == 2 && (strcmp(argv[1], "alloc") == 0 ||
+                      strcmp(argv[1], "delta") == 0)) {
+        r = fsbenchmark(argv[1][0] == 'a' ? FSBENCH_ALLOC : FSBENCH_DELTA);
+        if (r < 0)
+            printf("fsbench: %e\n", r);
+        return;
+    }
+    if (argc == 2 && strcmp(argv[1], "ring") == 0) {
+        ring();
+        return;
+    }
+    if (argc > 1)
+        nclients = strtol(argv[1], NULL, 10);
+    if (argc > 2)
+        nreqs = strtol(argv[2], NULL, 10);
+    if (argc > 3 || nclients <= 0 || nclients > MAXCLIENTS || nreqs <= 0) {
+        printf("Usage: fsbench [nclients [nreqs]] | alloc | delta | ring\n");
+        return;
+    }
+    if ((r = sys_page_alloc(0, bench, PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+        panic("sys_page_alloc: %e", r);
+
+    printf("%d clients, %d requests each\n", nclients, nreqs);
+    run("spin", nclients, nreqs, SPIN);
+    run("block", nclients, nreqs, BLOCK);
+    run("call", nclients, nreqs, CALL);
+}
@@ -0,0 +1,47 @@
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+    int r;
+    struct FsStats st;
+
+    binaryname = "fsstat";
+    if ((r = fsstats(&st)) < 0)
+        panic("fsstats: %e", r);
+    printf("dcache: %u hits, %u misses\n",
+           st.st_dcache_hits, st.st_dcache_misses);
+    printf("read-ahead: %u blocks, %u hits, %u wasted\n",
+           st.st_ra_blocks, st.st_ra_hits, st.st_ra_waste);
+    printf("block cache: %u/%u blocks, %u evictions, %u written back\n",
+           st.st_bc_blocks, st.st_bc_budget,
+           st.st_bc_evictions, st.st_bc_writebacks);
+    printf("reads: %u blocks in %u commands\n",
+           st.st_bc_blocks_read, st.st_bc_reads);
+    printf("writes: %u blocks in %u commands\n",
+           st.st_bc_blocks_written, st.st_bc_writes);
+    printf("allocation: %u blocks placed after the block before\n",
+           st.st_alloc_near);
+    printf("deltas: %u blocks in %u bytes, %u kept whole\n",
+           st.st_delta_blocks, st.st_delta_bytes, st.st_delta_full);
+    printf("dedup: %u blocks shared, %u fingerprinted\n",
+           st.st_dedup_hits, st.st_dedup_fps);
+    printf("compression: %u old blocks in %u bytes (%u saved), "
+           "%u did not compress\n",
+           st.st_lz_blocks, st.st_lz_bytes,
+           st.st_lz_blocks * BLKSIZE - st.st_lz_bytes, st.st_lz_full);
+    printf("  %u reads, %llu cycles/read\n", st.st_lz_reads,
+           st.st_lz_reads ? st.st_lz_read_cycles / st.st_lz_reads : 0);
+    printf("gc: %u old versions dropped, %u blocks freed\n",
+           st.st_gc_versions, st.st_gc_blocks);
+    printf("journal: %u commits of %u requests in %u blocks, "
+           "%u too big, %u replayed\n",
+           st.st_journal_commits, st.st_journal_txns, st.st_journal_blocks,
+           st.st_journal_overflows, st.st_journal_replays);
+    printf("revert: %u blocks shared\n", st.st_revert_blocks);
+    printf("mapped reads: %u blocks\n", st.st_map_reads);
+    printf("buffered: %u reads, %u writes\n",
+           st.st_buf_reads, st.st_buf_writes);
+    printf("rings: %u requests in %u batches, %u doorbells\n",
+           st.st_ring_requests, st.st_ring_batches, st.st_ring_doorbells);
+}
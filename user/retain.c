@@ -0,0 +1,78 @@
+#include <inc/lib.h>
+
+// Usage: retain [none | age:interval ...]
+//
+// Set the file system's version retention policy, then print it.
+// Each rule keeps one version per interval among versions up to age
+// old; an age of 0 means any age and an interval of 0 keeps every
+// version.  Times are in seconds, or take a suffix of m, h, d or w.
+// For example, "retain 1d:0 1w:1h 0:1d" keeps every version for a day,
+// hourly ones for a week and daily ones forever.
+
+static int
+parse_duration(const char *s, const char **end, uint32_t *secs)
+{
+    char *p;
+    long n = strtol(s, &p, 10);
+
+    if (p == s || n < 0)
+        return -E_INVAL;
+    switch (*p) {
+    case 'w': n *= 7;	/* fall through */
+    case 'd': n *= 24;	/* fall through */
+    case 'h': n *= 60;	/* fall through */
+    case 'm': n *= 60;
+        p++;
+        break;
+    case 's':
+        p++;
+        break;
+    }
+    *secs = n;
+    *end = p;
+    return 0;
+}
+
+static void
+usage(void)
+{
+    printf("usage: retain [none | age:interval ...]\n");
+    exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+    struct Retention rules[NRETAIN];
+    const char *p;
+    int i, n = -1;
+
+    binaryname = "retain";
+    if (argc > 1 && strcmp(argv[1], "none") == 0)
+        n = 0;
+    else if (argc > 1) {
+        if (argc - 1 > NRETAIN)
+            usage();
+        for (n = 0; n < argc - 1; n++)
+            if (parse_duration(argv[n + 1], &p, &rules[n].rt_age) < 0 ||
+                *p != ':' ||
+                parse_duration(p + 1, &p, &rules[n].rt_interval) < 0 ||
+                *p != '\0')
+                usage();
+    }
+
+    if ((n = fsretain(rules, n)) < 0)
+        panic("fsretain: %e", n);
+    if (n == 0)
+        printf("keeping every version\n");
+    for (i = 0; i < n; i++) {
+        if (rules[i].rt_age)
+            printf("up to %u s old: ", rules[i].rt_age);
+        else
+            printf("any age: ");
+        if (rules[i].rt_interval)
+            printf("one per %u s\n", rules[i].rt_interval);
+        else
+            printf("all\n");
+    }
+}